@@ -0,0 +1,93 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_BENCH_H_
+#define	_BENCH_H_
+
+#include <stdbool.h>
+
+#include <acfutils/glew.h>
+#include <cglm/cglm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Headless harness for running libhud outside of X-Plane. bench_egl.c
+ * sets up an offscreen OpenGL context, xplm_shim.c stands in for the
+ * parts of the XPLM API which libhud & libacfutils use, and obj8_shim.c
+ * replaces librain's OBJ8 renderer with synthetic glass & projection
+ * geometry.
+ */
+
+bool bench_egl_init(bool sw_render);
+void bench_egl_fini(void);
+const char *bench_egl_renderer(void);
+
+/*
+ * Offscreen render target, which stands in for X-Plane's main
+ * framebuffer. Its name is published in sim/graphics/view/current_gl_fbo.
+ */
+typedef struct {
+	GLuint		fbo;
+	GLuint		color_rb;
+	GLuint		depth_rb;
+	unsigned	w;
+	unsigned	h;
+} bench_fb_t;
+
+bool bench_fb_init(bench_fb_t *fb, unsigned w, unsigned h);
+void bench_fb_fini(bench_fb_t *fb);
+
+/*
+ * Sim state exposed through the stub datarefs. The matrices are in
+ * column-major order, as X-Plane publishes them.
+ */
+typedef struct {
+	mat4		proj_mtx;
+	mat4		acf_mtx;
+	int		vp[4];
+	int		fbo;
+	bool		rev_y;
+	bool		rev_float_z;
+	float		pitch;
+	float		roll;
+	float		hdg;
+} xplm_shim_view_t;
+
+void xplm_shim_init(void);
+void xplm_shim_fini(void);
+void xplm_shim_set_view(const xplm_shim_view_t *view);
+void xplm_shim_run_frame(const xplm_shim_view_t *eyes, unsigned num_eyes);
+
+/*
+ * The synthetic OBJs: a rectangular combiner glass of `w' x `h' meters,
+ * `dist' meters in front of the viewpoint. The projection object is the
+ * same rectangle, UV-mapped with the full surface.
+ */
+typedef struct obj8_s obj8_t;
+
+obj8_t *obj8_shim_rect(double w, double h, double dist);
+void obj8_shim_free(obj8_t *obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _BENCH_H_ */
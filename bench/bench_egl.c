@@ -0,0 +1,245 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/log.h>
+
+#include "bench.h"
+
+#ifndef	EGL_PLATFORM_SURFACELESS_MESA
+#define	EGL_PLATFORM_SURFACELESS_MESA	0x31DD
+#endif
+
+static EGLDisplay	dpy = EGL_NO_DISPLAY;
+static EGLContext	ctx = EGL_NO_CONTEXT;
+static EGLSurface	surf = EGL_NO_SURFACE;
+
+static bool
+egl_has_ext(EGLDisplay d, const char *ext)
+{
+	const char *exts = eglQueryString(d, EGL_EXTENSIONS);
+	size_t l = strlen(ext);
+
+	for (const char *p = exts; p != NULL && (p = strstr(p, ext)) != NULL;
+	    p += l) {
+		if ((p == exts || p[-1] == ' ') &&
+		    (p[l] == ' ' || p[l] == '\0'))
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Opens an EGL display which doesn't need a window system. With Mesa,
+ * this is the surfaceless platform, otherwise we fall back to the
+ * default display (e.g. a GPU driver's device platform).
+ */
+static EGLDisplay
+egl_display_open(void)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+	    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+	    "eglGetPlatformDisplayEXT");
+
+	if (get_platform_display != NULL &&
+	    egl_has_ext(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless")) {
+		EGLDisplay d = get_platform_display(
+		    EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+		if (d != EGL_NO_DISPLAY)
+			return (d);
+	}
+	return (eglGetDisplay(EGL_DEFAULT_DISPLAY));
+}
+
+/*
+ * Creates an offscreen OpenGL 4.5 compatibility profile context (the
+ * same kind of context X-Plane runs plugins in) and makes it current.
+ * With `sw_render' set, Mesa's llvmpipe software renderer is forced, so
+ * results are comparable between machines. This must be called before
+ * any other EGL or GL calls are made by the process.
+ */
+bool
+bench_egl_init(bool sw_render)
+{
+	static const EGLint cfg_attrs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_ALPHA_SIZE, 8,
+		EGL_NONE
+	};
+	static const EGLint ctx_attrs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 5,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK,
+		EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+	static const EGLint pbuf_attrs[] = {
+		EGL_WIDTH, 16,
+		EGL_HEIGHT, 16,
+		EGL_NONE
+	};
+	EGLConfig cfg;
+	EGLint num_cfgs = 0;
+	GLenum err;
+
+	ASSERT3P(dpy, ==, EGL_NO_DISPLAY);
+
+	if (sw_render)
+		setenv("LIBGL_ALWAYS_SOFTWARE", "1", 1);
+
+	dpy = egl_display_open();
+	if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, NULL, NULL)) {
+		logMsg("Error initializing EGL display: 0x%x", eglGetError());
+		dpy = EGL_NO_DISPLAY;
+		return (false);
+	}
+	if (!eglBindAPI(EGL_OPENGL_API) ||
+	    !eglChooseConfig(dpy, cfg_attrs, &cfg, 1, &num_cfgs) ||
+	    num_cfgs == 0) {
+		logMsg("Error choosing EGL config: 0x%x", eglGetError());
+		goto errout;
+	}
+	ctx = eglCreateContext(dpy, cfg, EGL_NO_CONTEXT, ctx_attrs);
+	if (ctx == EGL_NO_CONTEXT) {
+		logMsg("Error creating OpenGL 4.5 context: 0x%x",
+		    eglGetError());
+		goto errout;
+	}
+	/* We always render into our own FBO, so a surface is optional */
+	if (!egl_has_ext(dpy, "EGL_KHR_surfaceless_context")) {
+		surf = eglCreatePbufferSurface(dpy, cfg, pbuf_attrs);
+		if (surf == EGL_NO_SURFACE) {
+			logMsg("Error creating EGL pbuffer: 0x%x",
+			    eglGetError());
+			goto errout;
+		}
+	}
+	if (!eglMakeCurrent(dpy, surf, surf, ctx)) {
+		logMsg("Error making EGL context current: 0x%x",
+		    eglGetError());
+		goto errout;
+	}
+	/*
+	 * glewInit would try to initialize GLX as well, which isn't
+	 * available without an X display. We only need the GL entry
+	 * points and extension flags.
+	 */
+	glewExperimental = GL_TRUE;
+	err = glewContextInit();
+	if (err != GLEW_OK) {
+		logMsg("Error initializing GLEW: %s",
+		    glewGetErrorString(err));
+		goto errout;
+	}
+	/* GLEW can leave a spurious error set, clear it */
+	while (glGetError() != GL_NO_ERROR)
+		;
+
+	return (true);
+errout:
+	bench_egl_fini();
+	return (false);
+}
+
+void
+bench_egl_fini(void)
+{
+	if (dpy == EGL_NO_DISPLAY)
+		return;
+	eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (surf != EGL_NO_SURFACE) {
+		eglDestroySurface(dpy, surf);
+		surf = EGL_NO_SURFACE;
+	}
+	if (ctx != EGL_NO_CONTEXT) {
+		eglDestroyContext(dpy, ctx);
+		ctx = EGL_NO_CONTEXT;
+	}
+	eglTerminate(dpy);
+	dpy = EGL_NO_DISPLAY;
+}
+
+/*
+ * Returns the GL_RENDERER string of the current context, so benchmark
+ * results can be labeled with the renderer they were collected on.
+ */
+const char *
+bench_egl_renderer(void)
+{
+	const GLubyte *s = glGetString(GL_RENDERER);
+	return (s != NULL ? (const char *)s : "unknown");
+}
+
+bool
+bench_fb_init(bench_fb_t *fb, unsigned w, unsigned h)
+{
+	ASSERT(fb != NULL);
+	ASSERT(w != 0);
+	ASSERT(h != 0);
+
+	memset(fb, 0, sizeof (*fb));
+	fb->w = w;
+	fb->h = h;
+	glGenRenderbuffers(1, &fb->color_rb);
+	glBindRenderbuffer(GL_RENDERBUFFER, fb->color_rb);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+	glGenRenderbuffers(1, &fb->depth_rb);
+	glBindRenderbuffer(GL_RENDERBUFFER, fb->depth_rb);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	glGenFramebuffers(1, &fb->fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fb->fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	    GL_RENDERBUFFER, fb->color_rb);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+	    GL_RENDERBUFFER, fb->depth_rb);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		logMsg("Error setting up %ux%u benchmark framebuffer", w, h);
+		bench_fb_fini(fb);
+		return (false);
+	}
+	return (true);
+}
+
+void
+bench_fb_fini(bench_fb_t *fb)
+{
+	ASSERT(fb != NULL);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (fb->fbo != 0)
+		glDeleteFramebuffers(1, &fb->fbo);
+	if (fb->color_rb != 0)
+		glDeleteRenderbuffers(1, &fb->color_rb);
+	if (fb->depth_rb != 0)
+		glDeleteRenderbuffers(1, &fb->depth_rb);
+	memset(fb, 0, sizeof (*fb));
+}
@@ -0,0 +1,487 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+/*
+ * Headless libhud benchmark. Runs the HUD through its normal X-Plane
+ * frame path (capture & draw callbacks, see xplm_shim.c) in an offscreen
+ * EGL context and sweeps surface size, viewport size, surface format,
+ * glow and the number of eyes. For every combination, one JSON object
+ * per line is written to stdout, with the average CPU, wall clock and
+ * GPU time per frame and the HUD's own stats (see hud_stats_fmt_json).
+ *
+ * By default, the synthetic symbology is drawn with cairo through the
+ * HUD's mt_cairo_render instance, like most avionics feed the HUD. With
+ * -O, it is instead fed through the libhud-owned surface (see
+ * hud_surface_enable). Run with -h for usage.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/mt_cairo_render.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/time.h>
+
+#include "libhud.h"
+#include "bench.h"
+
+#define	MAX_SIZES	16
+#define	MARKER_SZ	48	/* moving marker, surface px */
+#define	MIN_SURF_SZ	(3 * MARKER_SZ)	/* fits the marker & symbology */
+/* Synthetic combiner glass, roughly the size of a real HUD combiner */
+#define	GLASS_W		0.25	/* meters */
+#define	GLASS_H		0.2	/* meters */
+#define	GLASS_DIST	0.6	/* meters */
+
+typedef struct {
+	unsigned	w;
+	unsigned	h;
+} size2_t;
+
+typedef struct {
+	const char	*shader_dir;
+	unsigned	frames;
+	unsigned	warmup;
+	size2_t		surf_sz[MAX_SIZES];
+	unsigned	num_surf_sz;
+	size2_t		vp_sz[MAX_SIZES];
+	unsigned	num_vp_sz;
+	bool		owned_surf;	/* feed hud_surface_submit, not mtcr */
+} opts_t;
+
+typedef struct {
+	size2_t		surf;
+	size2_t		vp;
+	bool		mono;
+	bool		glow;
+	unsigned	eyes;
+} config_t;
+
+static void
+log_func(const char *str)
+{
+	fputs(str, stderr);
+}
+
+/*
+ * Returns the vertical position of the moving marker on the left tape
+ * in `frame'. The marker steps down the tape by 3 pixels per frame.
+ */
+static unsigned
+marker_y(unsigned h, unsigned frame)
+{
+	unsigned range;
+
+	ASSERT3U(h, >=, MIN_SURF_SZ);
+	range = MAX(h - h / 3 - MARKER_SZ, 1);
+	return (h / 6 + (frame * 3) % range);
+}
+
+/*
+ * Draws the same synthetic symbology as symbology_draw & marker_step,
+ * but with cairo, for the mt_cairo_render mode. `userinfo' points to
+ * the number of the frame being drawn.
+ */
+static void
+mtcr_render_cb(cairo_t *cr, unsigned w, unsigned h, void *userinfo)
+{
+	const unsigned *frame = userinfo;
+	double r = MIN(w, h) / 16;
+
+	ASSERT(frame != NULL);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	cairo_set_source_rgb(cr, 0, 1, 0);
+	cairo_set_line_width(cr, 2);
+	for (unsigned y = h / 8; y < h - h / 8; y += h / 12) {
+		cairo_move_to(cr, w / 3, y + 1);
+		cairo_line_to(cr, w - w / 3, y + 1);
+	}
+	cairo_move_to(cr, w / 8, h / 6);
+	cairo_line_to(cr, w / 8, h - h / 6);
+	cairo_move_to(cr, w - w / 8, h / 6);
+	cairo_line_to(cr, w - w / 8, h - h / 6);
+	cairo_stroke(cr);
+	cairo_arc(cr, w / 2, h / 2, r, 0, 2 * M_PI);
+	cairo_stroke(cr);
+
+	cairo_set_source_rgb(cr, 0, 0.75, 0);
+	cairo_rectangle(cr, w / 8 + 4, marker_y(h, *frame), MARKER_SZ,
+	    MARKER_SZ);
+	cairo_fill(cr);
+}
+
+static void
+pixel_set(uint8_t *pixels, size_t stride, unsigned bpp, unsigned x,
+    unsigned y, uint8_t val)
+{
+	uint8_t *p = &pixels[y * stride + x * bpp];
+
+	if (bpp == 1) {
+		*p = val;
+	} else {
+		/* Premultiplied green, in BGRA byte order */
+		p[0] = 0;
+		p[1] = val;
+		p[2] = 0;
+		p[3] = val;
+	}
+}
+
+/*
+ * Draws static synthetic symbology: a boresight ring, a pitch-ladder-like
+ * set of horizontal lines and a frame around two tapes at the sides.
+ * This doesn't need to look like a HUD, but it should produce a similar
+ * amount of lit pixels & edges for the glow pass to work on.
+ */
+static void
+symbology_draw(uint8_t *pixels, unsigned w, unsigned h, unsigned bpp)
+{
+	size_t stride = (size_t)w * bpp;
+	unsigned r = MIN(w, h) / 16;
+
+	memset(pixels, 0, stride * h);
+	for (unsigned y = h / 8; y < h - h / 8; y += h / 12) {
+		for (unsigned x = w / 3; x < w - w / 3; x++) {
+			pixel_set(pixels, stride, bpp, x, y, 0xff);
+			pixel_set(pixels, stride, bpp, x, y + 1, 0xff);
+		}
+	}
+	for (unsigned y = h / 6; y < h - h / 6; y++) {
+		pixel_set(pixels, stride, bpp, w / 8, y, 0xff);
+		pixel_set(pixels, stride, bpp, w - w / 8, y, 0xff);
+	}
+	for (unsigned i = 0; i < 8 * r; i++) {
+		double a = (2 * M_PI * i) / (8 * r);
+
+		pixel_set(pixels, stride, bpp, w / 2 + r * cos(a),
+		    h / 2 + r * sin(a), 0xff);
+	}
+}
+
+/*
+ * Moves a filled marker box (think airspeed bug) one step down the left
+ * tape and fills in `rects' with the areas which changed.
+ */
+static void
+marker_step(uint8_t *pixels, unsigned w, unsigned h, unsigned bpp,
+    unsigned frame, hud_rect_t rects[2])
+{
+	size_t stride = (size_t)w * bpp;
+	unsigned x = w / 8 + 4;
+	unsigned y_old = marker_y(h, frame);
+	unsigned y_new = marker_y(h, frame + 1);
+
+	for (unsigned y = 0; y < MARKER_SZ; y++) {
+		for (unsigned dx = 0; dx < MARKER_SZ; dx++)
+			pixel_set(pixels, stride, bpp, x + dx, y_old + y, 0);
+	}
+	for (unsigned y = 0; y < MARKER_SZ; y++) {
+		for (unsigned dx = 0; dx < MARKER_SZ; dx++)
+			pixel_set(pixels, stride, bpp, x + dx, y_new + y, 0xc0);
+	}
+	rects[0] = (hud_rect_t){ x, y_old, MARKER_SZ, MARKER_SZ };
+	rects[1] = (hud_rect_t){ x, y_new, MARKER_SZ, MARKER_SZ };
+}
+
+/*
+ * Sets up the per-eye views. With two eyes, the framebuffer holds both
+ * eyes side by side, as with X-Plane's VR rendering.
+ */
+static void
+views_init(xplm_shim_view_t eyes[2], const config_t *cfg, GLuint fbo)
+{
+	for (unsigned i = 0; i < cfg->eyes; i++) {
+		xplm_shim_view_t *v = &eyes[i];
+
+		memset(v, 0, sizeof (*v));
+		glm_perspective(glm_rad(60), cfg->vp.w / (double)cfg->vp.h,
+		    0.05, 10000, v->proj_mtx);
+		glm_mat4_identity(v->acf_mtx);
+		v->vp[0] = i * cfg->vp.w;
+		v->vp[1] = 0;
+		v->vp[2] = cfg->vp.w;
+		v->vp[3] = cfg->vp.h;
+		v->fbo = fbo;
+		/* Keeps libhud from applying the OpenGL near plane fixup */
+		v->rev_float_z = true;
+	}
+}
+
+static bool
+run_config(const opts_t *opts, const config_t *cfg)
+{
+	const vect3_t green = VECT3(0, 1, 0);
+	unsigned bpp = (cfg->mono ? 1 : 4);
+	bench_fb_t fb;
+	obj8_t *glass, *proj;
+	mt_cairo_render_t *mtcr;
+	hud_t *hud;
+	uint8_t *pixels = NULL;
+	unsigned frame = 0;
+	xplm_shim_view_t eyes[2];
+	hud_stats_t stats;
+	uint64_t cpu_us = 0, wall_us = 0, t_start;
+	bool timed;
+	char *stats_json;
+	size_t stats_len;
+
+	if (!bench_fb_init(&fb, cfg->vp.w * cfg->eyes, cfg->vp.h))
+		return (false);
+	glass = obj8_shim_rect(GLASS_W, GLASS_H, GLASS_DIST);
+	proj = obj8_shim_rect(GLASS_W, GLASS_H, GLASS_DIST);
+	/* Renders only on request, see mt_cairo_render_once_wait below */
+	mtcr = mt_cairo_render_init(cfg->surf.w, cfg->surf.h, 0, NULL,
+	    mtcr_render_cb, NULL, &frame);
+	if (cfg->mono)
+		mt_cairo_render_set_monochrome(mtcr, green);
+	hud = hud_new(opts->shader_dir, mtcr, 0.1, glass, NULL, proj, NULL);
+	if (hud == NULL) {
+		logMsg("Error creating HUD, are the shaders in %s built?",
+		    opts->shader_dir);
+		mt_cairo_render_fini(mtcr);
+		obj8_shim_free(glass);
+		obj8_shim_free(proj);
+		bench_fb_fini(&fb);
+		return (false);
+	}
+	hud_set_glow(hud, cfg->glow, 2, green);
+	hud_set_enabled(hud, true);
+
+	if (opts->owned_surf) {
+		VERIFY(hud_surface_enable(hud, cfg->surf.w, cfg->surf.h,
+		    cfg->mono ? green : NULL_VECT3));
+		pixels = safe_malloc((size_t)cfg->surf.w * cfg->surf.h * bpp);
+		symbology_draw(pixels, cfg->surf.w, cfg->surf.h, bpp);
+		hud_surface_submit(hud, pixels, (size_t)cfg->surf.w * bpp,
+		    NULL, 0);
+	}
+	views_init(eyes, cfg, fb.fbo);
+
+	for (unsigned i = 0; i < opts->warmup + opts->frames; i++) {
+		hud_rect_t rects[2];
+		uint64_t t_cpu;
+
+		timed = (i >= opts->warmup);
+		if (i == opts->warmup)
+			hud_reset_stats(hud);
+		/*
+		 * The producer's drawing isn't timed, only what it costs
+		 * the HUD to pick up the new contents.
+		 */
+		if (opts->owned_surf) {
+			marker_step(pixels, cfg->surf.w, cfg->surf.h, bpp, i,
+			    rects);
+			hud_surface_submit(hud, pixels,
+			    (size_t)cfg->surf.w * bpp, rects, 2);
+		} else {
+			frame = i;
+			mt_cairo_render_once_wait(mtcr);
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+		glClearColor(0.2, 0.3, 0.5, 1);
+		glClearDepth(1);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		t_start = microclock();
+		xplm_shim_run_frame(eyes, cfg->eyes);
+		t_cpu = microclock();
+		/* Like vsync, keeps the GPU from queueing up frames */
+		glFinish();
+		if (timed) {
+			cpu_us += t_cpu - t_start;
+			wall_us += microclock() - t_start;
+		}
+	}
+	VERIFY3U(glGetError(), ==, GL_NO_ERROR);
+
+	hud_get_stats(hud, &stats);
+	stats_len = hud_stats_fmt_json(&stats, NULL, 0);
+	stats_json = safe_malloc(stats_len + 1);
+	hud_stats_fmt_json(&stats, stats_json, stats_len + 1);
+	printf("{\"renderer\":\"%s\",\"source\":\"%s\",\"surf_w\":%u,"
+	    "\"surf_h\":%u,\"vp_w\":%u,\"vp_h\":%u,\"mono\":%s,\"glow\":%s,"
+	    "\"eyes\":%u,\"frames\":%u,\"cpu_us\":%.1f,\"wall_us\":%.1f,",
+	    bench_egl_renderer(), opts->owned_surf ? "surface" : "mtcr",
+	    cfg->surf.w, cfg->surf.h, cfg->vp.w,
+	    cfg->vp.h, cfg->mono ? "true" : "false",
+	    cfg->glow ? "true" : "false", cfg->eyes, opts->frames,
+	    cpu_us / (double)opts->frames, wall_us / (double)opts->frames);
+	/* GPU time requires LIBHUD_STATS and timer query support */
+	if (stats.gpu_samples != 0) {
+		printf("\"gpu_us\":%.1f,", stats.gpu_us /
+		    (double)stats.gpu_samples * cfg->eyes);
+	} else {
+		printf("\"gpu_us\":null,");
+	}
+	printf("\"stats\":%s}\n", stats_json);
+	fflush(stdout);
+	free(stats_json);
+
+	hud_set_enabled(hud, false);
+	hud_destroy(hud);
+	mt_cairo_render_fini(mtcr);
+	obj8_shim_free(glass);
+	obj8_shim_free(proj);
+	free(pixels);
+	bench_fb_fini(&fb);
+
+	return (true);
+}
+
+/*
+ * Parses a comma-separated list of "WxH" sizes. Sizes smaller than
+ * `min' in either dimension are rejected.
+ */
+static bool
+sizes_parse(const char *str, unsigned min, size2_t *sizes, unsigned *num)
+{
+	char *s = safe_strdup(str), *saveptr = NULL;
+
+	*num = 0;
+	for (char *tok = strtok_r(s, ",", &saveptr); tok != NULL;
+	    tok = strtok_r(NULL, ",", &saveptr)) {
+		if (*num == MAX_SIZES ||
+		    sscanf(tok, "%ux%u", &sizes[*num].w, &sizes[*num].h) != 2 ||
+		    sizes[*num].w < min || sizes[*num].h < min) {
+			fprintf(stderr, "Invalid size list \"%s\" (sizes "
+			    "must be at least %ux%u)\n", str, min, min);
+			free(s);
+			return (false);
+		}
+		(*num)++;
+	}
+	free(s);
+	return (*num != 0);
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-ghO] [-s <shader_dir>] [-n <frames>] "
+	    "[-w <warmup>]\n"
+	    "\t[-S <WxH,...>] [-V <WxH,...>]\n"
+	    "  -s: directory with the compiled shaders "
+	    "(default: ../shaders/build)\n"
+	    "  -n: number of timed frames per configuration (default: 200)\n"
+	    "  -w: number of warmup frames per configuration (default: 20)\n"
+	    "  -S: surface sizes to sweep, at least %ux%u (default: "
+	    "512x512,1024x1024,2048x2048)\n"
+	    "  -V: per-eye viewport sizes to sweep (default: 1280x720,"
+	    "1920x1080,2560x1440)\n"
+	    "  -O: feed the libhud-owned surface (hud_surface_submit) "
+	    "instead of\n"
+	    "      rendering through mt_cairo_render\n"
+	    "  -g: use the system's GPU driver instead of llvmpipe\n",
+	    progname, MIN_SURF_SZ, MIN_SURF_SZ);
+}
+
+int
+main(int argc, char **argv)
+{
+	opts_t opts = {
+	    .shader_dir = "../shaders/build",
+	    .frames = 200,
+	    .warmup = 20
+	};
+	bool sw_render = true;
+	int opt;
+
+	log_init(log_func, "hud_bench");
+	VERIFY(sizes_parse("512x512,1024x1024,2048x2048", MIN_SURF_SZ,
+	    opts.surf_sz, &opts.num_surf_sz));
+	VERIFY(sizes_parse("1280x720,1920x1080,2560x1440", 1, opts.vp_sz,
+	    &opts.num_vp_sz));
+
+	while ((opt = getopt(argc, argv, "ghOs:n:w:S:V:")) != -1) {
+		switch (opt) {
+		case 'g':
+			sw_render = false;
+			break;
+		case 'O':
+			opts.owned_surf = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return (0);
+		case 's':
+			opts.shader_dir = optarg;
+			break;
+		case 'n':
+			opts.frames = atoi(optarg);
+			break;
+		case 'w':
+			opts.warmup = atoi(optarg);
+			break;
+		case 'S':
+			if (!sizes_parse(optarg, MIN_SURF_SZ, opts.surf_sz,
+			    &opts.num_surf_sz))
+				return (1);
+			break;
+		case 'V':
+			if (!sizes_parse(optarg, 1, opts.vp_sz,
+			    &opts.num_vp_sz))
+				return (1);
+			break;
+		default:
+			usage(argv[0]);
+			return (1);
+		}
+	}
+	if (opts.frames == 0) {
+		fprintf(stderr, "Number of frames must be at least 1\n");
+		return (1);
+	}
+
+	if (!bench_egl_init(sw_render))
+		return (1);
+	xplm_shim_init();
+
+	for (unsigned s = 0; s < opts.num_surf_sz; s++) {
+		for (unsigned v = 0; v < opts.num_vp_sz; v++) {
+			for (unsigned i = 0; i < 8; i++) {
+				const config_t cfg = {
+				    .surf = opts.surf_sz[s],
+				    .vp = opts.vp_sz[v],
+				    .mono = (i & 1) != 0,
+				    .glow = (i & 2) != 0,
+				    .eyes = (i & 4) != 0 ? 2 : 1
+				};
+
+				if (!run_config(&opts, &cfg))
+					goto errout;
+			}
+		}
+	}
+
+	xplm_shim_fini();
+	bench_egl_fini();
+	return (0);
+errout:
+	xplm_shim_fini();
+	bench_egl_fini();
+	return (1);
+}
@@ -0,0 +1,255 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+/*
+ * Replays a HUD trace recorded using hud_trace_start in an offscreen EGL
+ * context, outside of X-Plane. Every frame of the trace is rendered with
+ * the recorded parameters, matrices, viewports and surface contents, and
+ * the average CPU & wall clock time per frame plus the HUD's own stats
+ * are written to stdout as one JSON object per replay loop. This lets a
+ * performance problem seen in the sim be reproduced & measured against
+ * different libhud builds. Run with -h for usage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+#include <acfutils/log.h>
+#include <acfutils/mt_cairo_render.h>
+#include <acfutils/safe_alloc.h>
+#include <acfutils/time.h>
+
+#include "libhud.h"
+#include "hud_trace.h"
+#include "bench.h"
+
+/* Synthetic combiner glass, see hud_bench.c */
+#define	GLASS_W		0.25	/* meters */
+#define	GLASS_H		0.2	/* meters */
+#define	GLASS_DIST	0.6	/* meters */
+
+static void
+log_func(const char *str)
+{
+	fputs(str, stderr);
+}
+
+static void
+mtcr_render_cb(cairo_t *cr, unsigned w, unsigned h, void *userinfo)
+{
+	/* Placeholder, the surface is fed from the trace */
+	UNUSED(cr);
+	UNUSED(w);
+	UNUSED(h);
+	UNUSED(userinfo);
+}
+
+/*
+ * Scans the whole trace to determine the framebuffer size needed to
+ * hold all recorded viewports. Returns false if the trace has no valid
+ * frames.
+ */
+static bool
+trace_fb_size(hud_replay_t *replay, unsigned *w, unsigned *h,
+    unsigned *num_frames)
+{
+	hud_trace_frame_t frame;
+
+	*w = 0;
+	*h = 0;
+	*num_frames = 0;
+	hud_replay_rewind(replay);
+	while (hud_replay_next(replay, &frame)) {
+		for (unsigned i = 0; i < frame.num_eyes; i++) {
+			*w = MAX(*w, MAX(frame.vp[i][0], 0) + frame.vp[i][2]);
+			*h = MAX(*h, MAX(frame.vp[i][1], 0) + frame.vp[i][3]);
+		}
+		(*num_frames)++;
+	}
+	hud_replay_rewind(replay);
+
+	return (*num_frames != 0);
+}
+
+/*
+ * Replays the whole trace once. Returns false if a frame couldn't be
+ * applied to the HUD.
+ */
+static bool
+replay_loop(hud_replay_t *replay, hud_t *hud, const bench_fb_t *fb,
+    unsigned loop)
+{
+	hud_trace_frame_t frame;
+	hud_stats_t stats;
+	uint64_t cpu_us = 0, wall_us = 0;
+	unsigned frames = 0;
+	char *stats_json;
+	size_t stats_len;
+
+	hud_replay_rewind(replay);
+	hud_reset_stats(hud);
+	while (hud_replay_next(replay, &frame)) {
+		xplm_shim_view_t view = { .fbo = fb->fbo };
+		uint64_t t_start, t_cpu;
+
+		if (!hud_replay_apply(replay, hud, &frame)) {
+			logMsg("Error applying trace frame %d",
+			    (int)frame.frame);
+			return (false);
+		}
+		view.rev_y = frame.rev_y;
+		view.rev_float_z = frame.rev_float_z;
+		view.vp[2] = fb->w;
+		view.vp[3] = fb->h;
+		/* libhud restores the framebuffer binding X-Plane reports */
+		xplm_shim_set_view(&view);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, fb->fbo);
+		glViewport(0, 0, fb->w, fb->h);
+		glClearColor(0.2, 0.3, 0.5, 1);
+		glClearDepth(frame.rev_float_z ? 0 : 1);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		t_start = microclock();
+		hud_replay_render(hud, &frame);
+		t_cpu = microclock();
+		glFinish();
+		cpu_us += t_cpu - t_start;
+		wall_us += microclock() - t_start;
+		frames++;
+	}
+	if (frames == 0)
+		return (false);
+
+	hud_get_stats(hud, &stats);
+	stats_len = hud_stats_fmt_json(&stats, NULL, 0);
+	stats_json = safe_malloc(stats_len + 1);
+	hud_stats_fmt_json(&stats, stats_json, stats_len + 1);
+	printf("{\"renderer\":\"%s\",\"loop\":%u,\"frames\":%u,"
+	    "\"cpu_us\":%.1f,\"wall_us\":%.1f,\"stats\":%s}\n",
+	    bench_egl_renderer(), loop, frames, cpu_us / (double)frames,
+	    wall_us / (double)frames, stats_json);
+	fflush(stdout);
+	free(stats_json);
+
+	return (true);
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-gh] [-s <shader_dir>] [-l <loops>] "
+	    "<trace_file>\n"
+	    "  -s: directory with the compiled shaders "
+	    "(default: ../shaders/build)\n"
+	    "  -l: number of times to replay the trace (default: 3)\n"
+	    "  -g: use the system's GPU driver instead of llvmpipe\n",
+	    progname);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *shader_dir = "../shaders/build";
+	unsigned loops = 3, fb_w, fb_h, num_frames;
+	bool sw_render = true, ok = true;
+	hud_replay_t *replay;
+	bench_fb_t fb;
+	obj8_t *glass, *proj;
+	mt_cairo_render_t *mtcr;
+	hud_t *hud;
+	int opt;
+
+	log_init(log_func, "hud_replay");
+	while ((opt = getopt(argc, argv, "ghs:l:")) != -1) {
+		switch (opt) {
+		case 'g':
+			sw_render = false;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return (0);
+		case 's':
+			shader_dir = optarg;
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return (1);
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return (1);
+	}
+
+	replay = hud_replay_open(argv[optind]);
+	if (replay == NULL)
+		return (1);
+	if (!trace_fb_size(replay, &fb_w, &fb_h, &num_frames)) {
+		logMsg("Trace %s contains no frames", argv[optind]);
+		hud_replay_close(replay);
+		return (1);
+	}
+	if (!hud_replay_has_pixels(replay)) {
+		logMsg("Trace %s was recorded without surface pixels, the "
+		    "HUD surface will stay blank", argv[optind]);
+	}
+	if (!bench_egl_init(sw_render)) {
+		hud_replay_close(replay);
+		return (1);
+	}
+	xplm_shim_init();
+	if (!bench_fb_init(&fb, fb_w, fb_h)) {
+		ok = false;
+		goto out_egl;
+	}
+	glass = obj8_shim_rect(GLASS_W, GLASS_H, GLASS_DIST);
+	proj = obj8_shim_rect(GLASS_W, GLASS_H, GLASS_DIST);
+	mtcr = mt_cairo_render_init(16, 16, 0, NULL, mtcr_render_cb, NULL,
+	    NULL);
+	hud = hud_new(shader_dir, mtcr, 0.1, glass, NULL, proj, NULL);
+	if (hud == NULL) {
+		logMsg("Error creating HUD, are the shaders in %s built?",
+		    shader_dir);
+		ok = false;
+		goto out_objs;
+	}
+
+	for (unsigned i = 0; ok && i < loops; i++)
+		ok = replay_loop(replay, hud, &fb, i);
+	VERIFY3U(glGetError(), ==, GL_NO_ERROR);
+
+	hud_destroy(hud);
+out_objs:
+	mt_cairo_render_fini(mtcr);
+	obj8_shim_free(glass);
+	obj8_shim_free(proj);
+	bench_fb_fini(&fb);
+out_egl:
+	xplm_shim_fini();
+	bench_egl_fini();
+	hud_replay_close(replay);
+
+	return (ok ? 0 : 1);
+}
@@ -0,0 +1,43 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+/*
+ * Minimal stand-in for librain.h, declaring just the OBJ8 interface
+ * which libhud uses. See obj8_shim.c.
+ */
+
+#ifndef	_LIBRAIN_H_
+#define	_LIBRAIN_H_
+
+#include <acfutils/glew.h>
+#include <cglm/cglm.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct obj8_s obj8_t;
+
+void obj8_draw_group(obj8_t *obj, const char *groupname, GLuint prog,
+    const mat4 pvm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _LIBRAIN_H_ */
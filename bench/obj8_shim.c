@@ -0,0 +1,132 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+/*
+ * Replacement for librain's OBJ8 renderer. Instead of parsing OBJ files,
+ * we generate a single rectangle facing the viewer, which serves as both
+ * the combiner glass and the projection object. The vertex layout and
+ * the attribute & uniform names match what librain feeds libhud's
+ * shaders, so the shaders run exactly as they would in the sim.
+ */
+
+#include <stddef.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/safe_alloc.h>
+
+#include "bench.h"
+#include "librain.h"
+
+typedef struct {
+	GLfloat		pos[3];
+	GLfloat		norm[3];
+	GLfloat		tex0[2];
+} vtx_t;
+
+struct obj8_s {
+	GLuint		vao;
+	GLuint		vbo;
+	GLuint		ibo;
+};
+
+/*
+ * Creates the synthetic OBJ. The rectangle is centered on the -Z axis
+ * (the default view direction) `dist' meters out, with the top left
+ * corner of the surface mapped to its top left corner.
+ */
+obj8_t *
+obj8_shim_rect(double w, double h, double dist)
+{
+	const vtx_t vtx[4] = {
+	    { { -w / 2, -h / 2, -dist }, { 0, 0, 1 }, { 0, 1 } },
+	    { { w / 2, -h / 2, -dist }, { 0, 0, 1 }, { 1, 1 } },
+	    { { w / 2, h / 2, -dist }, { 0, 0, 1 }, { 1, 0 } },
+	    { { -w / 2, h / 2, -dist }, { 0, 0, 1 }, { 0, 0 } }
+	};
+	const GLuint idx[6] = { 0, 1, 2, 0, 2, 3 };
+	obj8_t *obj = safe_calloc(1, sizeof (*obj));
+
+	ASSERT3F(w, >, 0);
+	ASSERT3F(h, >, 0);
+	ASSERT3F(dist, >, 0);
+
+	glGenVertexArrays(1, &obj->vao);
+	glBindVertexArray(obj->vao);
+	glGenBuffers(1, &obj->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof (vtx), vtx, GL_STATIC_DRAW);
+	glGenBuffers(1, &obj->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof (idx), idx,
+	    GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	return (obj);
+}
+
+void
+obj8_shim_free(obj8_t *obj)
+{
+	if (obj == NULL)
+		return;
+	glDeleteVertexArrays(1, &obj->vao);
+	glDeleteBuffers(1, &obj->vbo);
+	glDeleteBuffers(1, &obj->ibo);
+	free(obj);
+}
+
+static void
+attr_setup(GLuint prog, const char *name, GLint size, size_t off)
+{
+	GLint loc = glGetAttribLocation(prog, name);
+
+	if (loc == -1)
+		return;
+	glEnableVertexAttribArray(loc);
+	glVertexAttribPointer(loc, size, GL_FLOAT, GL_FALSE, sizeof (vtx_t),
+	    (void *)off);
+}
+
+/*
+ * Draws the synthetic rectangle. As with librain, `prog' must already
+ * be bound and the `pvm' uniform is set up here. The rectangle is the
+ * only group, so `groupname' is ignored.
+ */
+void
+obj8_draw_group(obj8_t *obj, const char *groupname, GLuint prog,
+    const mat4 pvm)
+{
+	GLint loc;
+
+	ASSERT(obj != NULL);
+	UNUSED(groupname);
+
+	loc = glGetUniformLocation(prog, "pvm");
+	if (loc != -1)
+		glUniformMatrix4fv(loc, 1, GL_FALSE, (const GLfloat *)pvm);
+	glBindVertexArray(obj->vao);
+	glBindBuffer(GL_ARRAY_BUFFER, obj->vbo);
+	attr_setup(prog, "vtx_pos", 3, offsetof(vtx_t, pos));
+	attr_setup(prog, "vtx_norm", 3, offsetof(vtx_t, norm));
+	attr_setup(prog, "vtx_tex0", 2, offsetof(vtx_t, tex0));
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, NULL);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
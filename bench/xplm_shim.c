@@ -0,0 +1,434 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+/*
+ * Stub implementations of the XPLM functions which libhud and the parts
+ * of libacfutils it pulls in call. Datarefs are served from a small
+ * table of the view state X-Plane would publish, draw callbacks are
+ * collected and then invoked by xplm_shim_run_frame in the same order
+ * X-Plane invokes them, and textures are bound directly.
+ *
+ * If your libacfutils build references additional XPLM functions, the
+ * link will fail with undefined XPLM* symbols. Add trivial stubs for
+ * them here, nothing libhud does through them matters to a benchmark.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <XPLMDataAccess.h>
+#include <XPLMDisplay.h>
+#include <XPLMGraphics.h>
+#include <XPLMPlugin.h>
+#include <XPLMUtilities.h>
+
+#include <acfutils/assert.h>
+#include <acfutils/helpers.h>
+
+#include "bench.h"
+
+#define	MAX_DRAW_CBS	16
+
+/* Values of sim/graphics/view/draw_call_type */
+#define	DCT_MONO	1
+#define	DCT_LEFT_EYE	3
+#define	DCT_RIGHT_EYE	4
+
+typedef struct {
+	const char	*name;
+	XPLMDataTypeID	type;
+	int		*ivals;
+	float		*fvals;
+	int		n;
+} shim_dr_t;
+
+typedef struct {
+	XPLMDrawCallback_f	cb;
+	XPLMDrawingPhase	phase;
+	int			before;
+	void			*refcon;
+} shim_draw_cb_t;
+
+static struct {
+	int		fbo;
+	int		dct;
+	int		plane_render_type;
+	int		world_render_type;
+	float		proj_mtx[16];
+	float		acf_mtx[16];
+	int		vp[4];
+	int		rev_y;
+	int		rev_float_z;
+	float		theta;
+	float		phi;
+	float		psi;
+} view;
+
+static shim_dr_t drs[] = {
+    { "sim/graphics/view/current_gl_fbo", xplmType_Int, &view.fbo, NULL, 1 },
+    { "sim/graphics/view/draw_call_type", xplmType_Int, &view.dct, NULL, 1 },
+    { "sim/graphics/view/plane_render_type", xplmType_Int,
+	&view.plane_render_type, NULL, 1 },
+    { "sim/graphics/view/world_render_type", xplmType_Int,
+	&view.world_render_type, NULL, 1 },
+    { "sim/graphics/view/projection_matrix", xplmType_FloatArray, NULL,
+	view.proj_mtx, 16 },
+    { "sim/graphics/view/projection_matrix_3d", xplmType_FloatArray, NULL,
+	view.proj_mtx, 16 },
+    { "sim/graphics/view/acf_matrix", xplmType_FloatArray, NULL,
+	view.acf_mtx, 16 },
+    { "sim/graphics/view/viewport", xplmType_IntArray, view.vp, NULL, 4 },
+    { "sim/graphics/view/is_reverse_y", xplmType_Int, &view.rev_y, NULL, 1 },
+    { "sim/graphics/view/is_reverse_float_z", xplmType_Int,
+	&view.rev_float_z, NULL, 1 },
+    { "sim/flightmodel/position/theta", xplmType_Float, NULL,
+	&view.theta, 1 },
+    { "sim/flightmodel/position/phi", xplmType_Float, NULL, &view.phi, 1 },
+    { "sim/flightmodel/position/psi", xplmType_Float, NULL, &view.psi, 1 },
+    { NULL, 0, NULL, NULL, 0 }
+};
+
+static shim_draw_cb_t	draw_cbs[MAX_DRAW_CBS];
+static unsigned		num_draw_cbs = 0;
+
+void
+xplm_shim_init(void)
+{
+	memset(&view, 0, sizeof (view));
+	view.dct = DCT_MONO;
+	num_draw_cbs = 0;
+}
+
+void
+xplm_shim_fini(void)
+{
+	/* Anything still registered belongs to a leaked HUD */
+	VERIFY0(num_draw_cbs);
+}
+
+/*
+ * Publishes `v' through the view datarefs. `draw_call_type' is left
+ * alone, see xplm_shim_run_frame.
+ */
+void
+xplm_shim_set_view(const xplm_shim_view_t *v)
+{
+	ASSERT(v != NULL);
+
+	memcpy(view.proj_mtx, v->proj_mtx, sizeof (view.proj_mtx));
+	memcpy(view.acf_mtx, v->acf_mtx, sizeof (view.acf_mtx));
+	memcpy(view.vp, v->vp, sizeof (view.vp));
+	view.fbo = v->fbo;
+	view.rev_y = v->rev_y;
+	view.rev_float_z = v->rev_float_z;
+	view.theta = v->pitch;
+	view.phi = v->roll;
+	view.psi = v->hdg;
+}
+
+static void
+run_draw_cbs(XPLMDrawingPhase phase, int before)
+{
+	for (unsigned i = 0; i < num_draw_cbs; i++) {
+		if (draw_cbs[i].phase == phase && draw_cbs[i].before == before)
+			draw_cbs[i].cb(phase, before, draw_cbs[i].refcon);
+	}
+}
+
+/*
+ * Simulates one X-Plane frame. The 3D scene is drawn once per eye
+ * (invoking the xplm_Phase_Modern3D callbacks with that eye's view and
+ * draw call type), followed by a single 2D window phase.
+ */
+void
+xplm_shim_run_frame(const xplm_shim_view_t *eyes, unsigned num_eyes)
+{
+	ASSERT(eyes != NULL);
+	ASSERT(num_eyes == 1 || num_eyes == 2);
+
+	for (unsigned i = 0; i < num_eyes; i++) {
+		xplm_shim_set_view(&eyes[i]);
+		if (num_eyes == 1)
+			view.dct = DCT_MONO;
+		else
+			view.dct = (i == 0 ? DCT_LEFT_EYE : DCT_RIGHT_EYE);
+		glBindFramebuffer(GL_FRAMEBUFFER, view.fbo);
+		run_draw_cbs(xplm_Phase_Modern3D, 1);
+		run_draw_cbs(xplm_Phase_Modern3D, 0);
+	}
+	view.dct = DCT_MONO;
+	run_draw_cbs(xplm_Phase_Window, 1);
+	run_draw_cbs(xplm_Phase_Window, 0);
+}
+
+int
+XPLMRegisterDrawCallback(XPLMDrawCallback_f cb, XPLMDrawingPhase phase,
+    int before, void *refcon)
+{
+	VERIFY3U(num_draw_cbs, <, MAX_DRAW_CBS);
+	draw_cbs[num_draw_cbs].cb = cb;
+	draw_cbs[num_draw_cbs].phase = phase;
+	draw_cbs[num_draw_cbs].before = before;
+	draw_cbs[num_draw_cbs].refcon = refcon;
+	num_draw_cbs++;
+	return (1);
+}
+
+int
+XPLMUnregisterDrawCallback(XPLMDrawCallback_f cb, XPLMDrawingPhase phase,
+    int before, void *refcon)
+{
+	for (unsigned i = 0; i < num_draw_cbs; i++) {
+		if (draw_cbs[i].cb == cb && draw_cbs[i].phase == phase &&
+		    draw_cbs[i].before == before &&
+		    draw_cbs[i].refcon == refcon) {
+			memmove(&draw_cbs[i], &draw_cbs[i + 1],
+			    (num_draw_cbs - i - 1) * sizeof (*draw_cbs));
+			num_draw_cbs--;
+			return (1);
+		}
+	}
+	return (0);
+}
+
+XPLMDataRef
+XPLMFindDataRef(const char *name)
+{
+	for (shim_dr_t *dr = drs; dr->name != NULL; dr++) {
+		if (strcmp(dr->name, name) == 0)
+			return (dr);
+	}
+	return (NULL);
+}
+
+int
+XPLMIsDataRefGood(XPLMDataRef ref)
+{
+	return (ref != NULL);
+}
+
+int
+XPLMCanWriteDataRef(XPLMDataRef ref)
+{
+	UNUSED(ref);
+	return (0);
+}
+
+XPLMDataTypeID
+XPLMGetDataRefTypes(XPLMDataRef ref)
+{
+	return (((const shim_dr_t *)ref)->type);
+}
+
+int
+XPLMGetDatai(XPLMDataRef ref)
+{
+	const shim_dr_t *dr = ref;
+
+	if (dr->ivals != NULL)
+		return (dr->ivals[0]);
+	if (dr->fvals != NULL)
+		return (dr->fvals[0]);
+	return (0);
+}
+
+float
+XPLMGetDataf(XPLMDataRef ref)
+{
+	const shim_dr_t *dr = ref;
+
+	if (dr->fvals != NULL)
+		return (dr->fvals[0]);
+	if (dr->ivals != NULL)
+		return (dr->ivals[0]);
+	return (0);
+}
+
+double
+XPLMGetDatad(XPLMDataRef ref)
+{
+	return (XPLMGetDataf(ref));
+}
+
+int
+XPLMGetDatavi(XPLMDataRef ref, int *out, int off, int max)
+{
+	const shim_dr_t *dr = ref;
+	int n;
+
+	if (dr->type != xplmType_IntArray)
+		return (0);
+	if (out == NULL)
+		return (dr->n);
+	n = MAX(MIN(max, dr->n - off), 0);
+	memcpy(out, &dr->ivals[off], n * sizeof (*out));
+	return (n);
+}
+
+int
+XPLMGetDatavf(XPLMDataRef ref, float *out, int off, int max)
+{
+	const shim_dr_t *dr = ref;
+	int n;
+
+	if (dr->type != xplmType_FloatArray)
+		return (0);
+	if (out == NULL)
+		return (dr->n);
+	n = MAX(MIN(max, dr->n - off), 0);
+	memcpy(out, &dr->fvals[off], n * sizeof (*out));
+	return (n);
+}
+
+int
+XPLMGetDatab(XPLMDataRef ref, void *out, int off, int max)
+{
+	UNUSED(ref);
+	UNUSED(out);
+	UNUSED(off);
+	UNUSED(max);
+	return (0);
+}
+
+/* None of the view datarefs are writable */
+
+void
+XPLMSetDatai(XPLMDataRef ref, int val)
+{
+	UNUSED(ref);
+	UNUSED(val);
+}
+
+void
+XPLMSetDataf(XPLMDataRef ref, float val)
+{
+	UNUSED(ref);
+	UNUSED(val);
+}
+
+void
+XPLMSetDatad(XPLMDataRef ref, double val)
+{
+	UNUSED(ref);
+	UNUSED(val);
+}
+
+void
+XPLMSetDatavi(XPLMDataRef ref, int *vals, int off, int n)
+{
+	UNUSED(ref);
+	UNUSED(vals);
+	UNUSED(off);
+	UNUSED(n);
+}
+
+void
+XPLMSetDatavf(XPLMDataRef ref, float *vals, int off, int n)
+{
+	UNUSED(ref);
+	UNUSED(vals);
+	UNUSED(off);
+	UNUSED(n);
+}
+
+void
+XPLMSetDatab(XPLMDataRef ref, void *vals, int off, int n)
+{
+	UNUSED(ref);
+	UNUSED(vals);
+	UNUSED(off);
+	UNUSED(n);
+}
+
+void
+XPLMBindTexture2d(int tex, int unit)
+{
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+void
+XPLMGenerateTextureNumbers(int *tex, int count)
+{
+	glGenTextures(count, (GLuint *)tex);
+}
+
+void
+XPLMDebugString(const char *str)
+{
+	fputs(str, stderr);
+}
+
+void
+XPLMGetSystemPath(char *path)
+{
+	strcpy(path, "./");
+}
+
+void
+XPLMGetPrefsPath(char *path)
+{
+	strcpy(path, "./bench.prf");
+}
+
+const char *
+XPLMGetDirectorySeparator(void)
+{
+	return ("/");
+}
+
+void
+XPLMGetVersions(int *xp_ver, int *xplm_ver, XPLMHostApplicationID *host)
+{
+	if (xp_ver != NULL)
+		*xp_ver = 12000;
+	if (xplm_ver != NULL)
+		*xplm_ver = 400;
+	if (host != NULL)
+		*host = xplm_Host_XPlane;
+}
+
+XPLMPluginID
+XPLMGetMyID(void)
+{
+	return (0);
+}
+
+void
+XPLMGetPluginInfo(XPLMPluginID id, char *name, char *path, char *sig,
+    char *desc)
+{
+	UNUSED(id);
+	if (name != NULL)
+		strcpy(name, "libhud-bench");
+	if (path != NULL)
+		strcpy(path, "./libhud-bench");
+	if (sig != NULL)
+		strcpy(sig, "libhud.bench");
+	if (desc != NULL)
+		strcpy(desc, "libhud headless benchmark");
+}
+
+XPLMPluginID
+XPLMFindPluginBySignature(const char *sig)
+{
+	UNUSED(sig);
+	return (XPLM_NO_PLUGIN_ID);
+}
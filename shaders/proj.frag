@@ -14,6 +14,33 @@
 
 #version 460
 
+/*
+ * Feature switches, set as specialization constants when libhud links
+ * the shader (see proj_shader_get in libhud.c). Branches on these are
+ * resolved at specialization time, so disabled features cost nothing.
+ *
+ * GLOW: 0 = no glow, 1 = full 25-tap glow, 2 = reduced 9-tap glow
+ *	covering the same footprint, used when the frame-time governor
+ *	needs to shed load.
+ * MONOCHROME: the surface is a monochrome (red channel only) surface
+ *	which is tinted using beam_color.
+ * PREMULTIPLIED: output premultiplied alpha, to be blended using
+ *	GL_ONE, GL_ONE_MINUS_SRC_ALPHA. Cairo surfaces are premultiplied
+ *	already, so this avoids un-premultiplying every fragment.
+ * MIPMAPPED: surf_tex has a full mip chain. The main pass then gets
+ *	trilinear filtering for free, while the glow taps explicitly read
+ *	from a level matching their spacing.
+ * REPROJECT: the surface is the conformal layer, rendered at a slightly
+ *	different aircraft attitude than the current one. uv_xform maps
+ *	from the current attitude's surface coordinates to the rendered
+ *	surface's coordinates (see conf_update in libhud.c).
+ */
+layout(constant_id = 0) const int	GLOW = 0;
+layout(constant_id = 1) const bool	MONOCHROME = false;
+layout(constant_id = 2) const bool	PREMULTIPLIED = false;
+layout(constant_id = 3) const bool	MIPMAPPED = false;
+layout(constant_id = 4) const bool	REPROJECT = false;
+
 layout(location = 10) uniform sampler2D	surf_tex;
 layout(location = 11) uniform vec2	surf_sz;
 layout(location = 12) uniform sampler2D	stencil_tex;
@@ -21,16 +48,18 @@ layout(location = 13) uniform vec2	stencil_sz;
 layout(location = 14) uniform vec4	vp;
 layout(location = 15) uniform float	brt;
 layout(location = 16) uniform float	blur_radius;
-
-#if	MONOCHROME
 layout(location = 20) uniform vec3	beam_color;
-#endif
+layout(location = 21) uniform mat3	uv_xform;
 
 layout(location = 0) in vec2		tex_coord;
 
 layout(location = 0) out vec4		color_out;
 
-#define GAUSS_SIZE 5
+const float gauss_kernel_lq[9] = float[9](
+    0.0625, 0.125, 0.0625,
+    0.125, 0.25, 0.125,
+    0.0625, 0.125, 0.0625
+);
 const float gauss_kernel[25] = float[25](
     0.01, 0.02, 0.04, 0.02, 0.01,
     0.02, 0.04, 0.08, 0.04, 0.02,
@@ -39,67 +68,135 @@ const float gauss_kernel[25] = float[25](
     0.01, 0.02, 0.04, 0.02, 0.01
 );
 
-#if	MONOCHROME
-#define BLUR_I(_x, _y, _row, _col) \
-	out_pixel.r += texture(surf_tex, tex_coord + vec2((_x), (_y)) * \
-	    blur_radius / surf_sz).r * \
-	    gauss_kernel[(_row) * GAUSS_SIZE + (_col)]
-#else	/* !MONOCHROME */
 #define BLUR_I(_x, _y, _row, _col) \
-	out_pixel += texture(surf_tex, tex_coord + vec2((_x), (_y)) * \
-	    blur_radius / surf_sz) * \
-	    gauss_kernel[(_row) * GAUSS_SIZE + (_col)]
-#endif	/* !MONOCHROME */
+	out_pixel += glow_sample(uv + vec2((_x), (_y)) * \
+	    blur_radius / surf_sz, glow_lod) * \
+	    gauss_kernel[(_row) * 5 + (_col)]
+#define BLUR_LQ_I(_x, _y, _row, _col) \
+	out_pixel += glow_sample(uv + vec2((_x), (_y)) * \
+	    2.0 * blur_radius / surf_sz, glow_lod) * \
+	    gauss_kernel_lq[(_row) * 3 + (_col)]
+
+vec4
+glow_sample(vec2 uv, float lod)
+{
+	if (MIPMAPPED)
+		return (textureLod(surf_tex, uv, lod));
+	else
+		return (texture(surf_tex, uv));
+}
+
+/*
+ * Returns the mip level to take glow taps from. The taps are spaced
+ * `spacing' texels apart, so reading from the level where a texel spans
+ * the tap spacing prefilters the gap between taps, instead of pulling
+ * scattered texels from the full resolution level. If the projection
+ * is minified even further than that, follow the screen footprint.
+ */
+float
+glow_lod_get(float spacing)
+{
+	vec2 footprint = max(abs(dFdx(tex_coord)), abs(dFdy(tex_coord))) *
+	    surf_sz;
+	return (log2(max(max(footprint.x, footprint.y), max(spacing, 1.0))));
+}
 
 void
 main(void)
 {
-	vec4 stencil_pix = texture(stencil_tex,
-	    (gl_FragCoord.xy - vp.xy) / stencil_sz);
-#if	GLOW
 	vec4 out_pixel = vec4(0.0);
-	/* row 0 */
-	BLUR_I(-2, -2, 0, 0);
-	BLUR_I(-1, -2, 0, 1);
-	BLUR_I(0, -2, 0, 2);
-	BLUR_I(1, -2, 0, 3);
-	BLUR_I(2, -2, 0, 4);
-	/* row 1 */
-	BLUR_I(-2, -1, 1, 0);
-	BLUR_I(-1, -1, 1, 1);
-	BLUR_I(0, -1, 1, 2);
-	BLUR_I(1, -1, 1, 3);
-	BLUR_I(2, -1, 1, 4);
-	/* row 2 */
-	BLUR_I(-2, 0, 2, 0);
-	BLUR_I(-1, 0, 2, 1);
-	BLUR_I(0, 0, 2, 2);;
-	BLUR_I(1, 0, 2, 3);
-	BLUR_I(2, 0, 2, 4);
-	/* row 3 */
-	BLUR_I(-2, 1, 3, 0);
-	BLUR_I(-1, 1, 3, 1);
-	BLUR_I(0, 1, 3, 2);
-	BLUR_I(1, 1, 3, 3);
-	BLUR_I(2, 1, 3, 4);
-	/* row 4 */
-	BLUR_I(-2, 2, 4, 0);
-	BLUR_I(-1, 2, 4, 1);
-	BLUR_I(0, 2, 4, 2);
-	BLUR_I(1, 2, 4, 3);
-	BLUR_I(2, 2, 4, 4);
-#else	/* !GLOW */
-	vec4 out_pixel = texture(surf_tex, tex_coord);
-#endif	/* !GLOW */
-#if	MONOCHROME
-	color_out = vec4(beam_color, out_pixel.r * stencil_pix.r * brt);
-#else	/* !MONOCHROME */
+	float glow_lod = 0.0;
+	vec2 uv = tex_coord;
+
+	if (REPROJECT) {
+		uv = (uv_xform * vec3(tex_coord, 1.0)).xy;
+		/* Nothing was rendered outside of the surface */
+		if (any(lessThan(uv, vec2(0.0))) ||
+		    any(greaterThan(uv, vec2(1.0)))) {
+			color_out = vec4(0.0);
+			return;
+		}
+	}
+	/*
+	 * The stencil may be rendered at a reduced resolution, so we
+	 * normalize by the viewport size, not the stencil texture size.
+	 */
+	float stencil = texture(stencil_tex,
+	    (gl_FragCoord.xy - vp.xy) / vp.zw).r;
+	float stencil_scale = vp.z / stencil_sz.x;
+	/*
+	 * At reduced stencil resolution, bilinear filtering smears the
+	 * glass edge across a whole stencil texel, i.e. several screen
+	 * pixels. The mask is a hard-edged silhouette, so re-sharpen the
+	 * ramp around the 50% crossing to span about one screen pixel.
+	 */
+	if (stencil_scale > 1.0) {
+		float w = 0.5 / stencil_scale;
+		stencil = smoothstep(0.5 - w, 0.5 + w, stencil);
+	}
+	if (MIPMAPPED && GLOW != 0)
+		glow_lod = glow_lod_get((GLOW == 2 ? 2.0 : 1.0) * blur_radius);
+	if (GLOW == 2) {
+		BLUR_LQ_I(-1, -1, 0, 0);
+		BLUR_LQ_I(0, -1, 0, 1);
+		BLUR_LQ_I(1, -1, 0, 2);
+		BLUR_LQ_I(-1, 0, 1, 0);
+		BLUR_LQ_I(0, 0, 1, 1);
+		BLUR_LQ_I(1, 0, 1, 2);
+		BLUR_LQ_I(-1, 1, 2, 0);
+		BLUR_LQ_I(0, 1, 2, 1);
+		BLUR_LQ_I(1, 1, 2, 2);
+	} else if (GLOW != 0) {
+		/* row 0 */
+		BLUR_I(-2, -2, 0, 0);
+		BLUR_I(-1, -2, 0, 1);
+		BLUR_I(0, -2, 0, 2);
+		BLUR_I(1, -2, 0, 3);
+		BLUR_I(2, -2, 0, 4);
+		/* row 1 */
+		BLUR_I(-2, -1, 1, 0);
+		BLUR_I(-1, -1, 1, 1);
+		BLUR_I(0, -1, 1, 2);
+		BLUR_I(1, -1, 1, 3);
+		BLUR_I(2, -1, 1, 4);
+		/* row 2 */
+		BLUR_I(-2, 0, 2, 0);
+		BLUR_I(-1, 0, 2, 1);
+		BLUR_I(0, 0, 2, 2);
+		BLUR_I(1, 0, 2, 3);
+		BLUR_I(2, 0, 2, 4);
+		/* row 3 */
+		BLUR_I(-2, 1, 3, 0);
+		BLUR_I(-1, 1, 3, 1);
+		BLUR_I(0, 1, 3, 2);
+		BLUR_I(1, 1, 3, 3);
+		BLUR_I(2, 1, 3, 4);
+		/* row 4 */
+		BLUR_I(-2, 2, 4, 0);
+		BLUR_I(-1, 2, 4, 1);
+		BLUR_I(0, 2, 4, 2);
+		BLUR_I(1, 2, 4, 3);
+		BLUR_I(2, 2, 4, 4);
+	} else {
+		out_pixel = texture(surf_tex, uv);
+	}
+	if (MONOCHROME) {
+		float a = out_pixel.r * stencil * brt;
+		if (PREMULTIPLIED)
+			color_out = vec4(beam_color * a, a);
+		else
+			color_out = vec4(beam_color, a);
+		return;
+	}
+	if (PREMULTIPLIED) {
+		color_out = out_pixel * (brt * stencil);
+		return;
+	}
 	out_pixel.a *= brt;
 	/*
 	 * If the alpha channel sums to less than 1.0, that means we need
 	 * to boost pixel brightness to avoid black borders around the pixel.
 	 */
 	color_out = vec4(out_pixel.rgb / max(out_pixel.a, 0.01),
-	    out_pixel.a * stencil_pix.r);
-#endif	/* !MONOCHROME */
+	    out_pixel.a * stencil);
 }
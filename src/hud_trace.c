@@ -0,0 +1,417 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <acfutils/crc64.h>
+#include <acfutils/glew.h>
+#include <acfutils/helpers.h>
+#include <acfutils/safe_alloc.h>
+
+#include "hud_trace.h"
+
+/* Sanity limits for the values read from a trace */
+#define	MAX_SURF_SZ	16384	/* pixels */
+#define	MAX_VP_SZ	65536	/* pixels */
+
+/*
+ * Replay side of the HUD trace facility. A replay tool sets up a GL
+ * context (e.g. a headless EGL pbuffer on llvmpipe), constructs a HUD
+ * using hud_new and then for each frame in the trace calls
+ * hud_replay_apply followed by hud_replay_render. See bench/hud_replay.c.
+ */
+struct hud_replay_s {
+	FILE		*fp;
+	long		data_off;
+	/*
+	 * The most recent surface record with pixels. Applied to the HUD
+	 * by the next hud_replay_apply call if `surf_new' is set.
+	 */
+	hud_trace_surf_t surf;
+	uint8_t		*pixels;
+	size_t		pixels_cap;
+	bool		surf_new;
+	/* Set once any surface record carrying pixels has been read */
+	bool		has_pixels;
+	/* Format of the surface we last enabled on the HUD */
+	hud_trace_surf_t surf_applied;
+};
+
+/**
+ * Opens a HUD trace file previously recorded using hud_trace_start.
+ *
+ * @return The replay handle, or NULL if the file couldn't be opened or
+ *	isn't a compatible HUD trace. Errors are logged.
+ */
+hud_replay_t *
+hud_replay_open(const char *filename)
+{
+	hud_replay_t *replay;
+	hud_trace_hdr_t hdr;
+	FILE *fp;
+
+	ASSERT(filename != NULL);
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		logMsg("Can't open HUD trace %s: %s", filename,
+		    strerror(errno));
+		return (NULL);
+	}
+	if (fread(&hdr, sizeof (hdr), 1, fp) != 1 ||
+	    hdr.magic != HUD_TRACE_MAGIC) {
+		logMsg("Can't open HUD trace %s: not a HUD trace file",
+		    filename);
+		fclose(fp);
+		return (NULL);
+	}
+	if (hdr.version != HUD_TRACE_VERSION) {
+		logMsg("Can't open HUD trace %s: unsupported version %d",
+		    filename, (int)hdr.version);
+		fclose(fp);
+		return (NULL);
+	}
+	replay = safe_calloc(1, sizeof (*replay));
+	replay->fp = fp;
+	replay->data_off = ftell(fp);
+
+	return (replay);
+}
+
+/**
+ * Closes a HUD trace replay handle.
+ */
+void
+hud_replay_close(hud_replay_t *replay)
+{
+	ASSERT(replay != NULL);
+	fclose(replay->fp);
+	free(replay->pixels);
+	free(replay);
+}
+
+static bool
+is_bool(uint8_t val)
+{
+	return (val == 0 || val == 1);
+}
+
+static bool
+floats_finite(const float *vals, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		if (!isfinite(vals[i]))
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Checks that every value in a frame record is within the range which
+ * the HUD setters and hud_render_eye accept, so a corrupt or hostile
+ * trace can't trip an assertion in libhud. This mustn't be any stricter
+ * than the setters themselves, or valid recordings get rejected.
+ */
+static bool
+frame_valid(const hud_trace_frame_t *frame)
+{
+	ASSERT(frame != NULL);
+
+	if (frame->magic != HUD_TRACE_FRAME_MAGIC ||
+	    frame->num_eyes < 1 || frame->num_eyes > 2 ||
+	    !is_bool(frame->rev_y) || !is_bool(frame->rev_float_z) ||
+	    !is_bool(frame->glow) || !is_bool(frame->depth_test) ||
+	    !is_bool(frame->premul) || !is_bool(frame->surface_mips) ||
+	    (frame->stencil_scale != 1 && frame->stencil_scale != 2 &&
+	    frame->stencil_scale != 4))
+		return (false);
+	if (!floats_finite(frame->fsaa_ratio, 2) ||
+	    !isfinite(frame->brt) || frame->brt < 0 ||
+	    !isfinite(frame->blur_radius) || frame->blur_radius < 0 ||
+	    !isfinite(frame->glass_opacity) || frame->glass_opacity < 0 ||
+	    !isfinite(frame->gpu_budget) || frame->gpu_budget < 0)
+		return (false);
+	/* An unset glow color (NULL_VECT3) is recorded as all NaNs */
+	if (!floats_finite(frame->glow_color, 3) &&
+	    !(isnan(frame->glow_color[0]) && isnan(frame->glow_color[1]) &&
+	    isnan(frame->glow_color[2])))
+		return (false);
+	if (frame->surf_w > MAX_SURF_SZ || frame->surf_h > MAX_SURF_SZ)
+		return (false);
+	for (unsigned i = 0; i < frame->num_eyes; i++) {
+		if (!floats_finite(frame->proj_mtx[i], 16) ||
+		    !floats_finite(frame->acf_mtx[i], 16) ||
+		    !floats_finite(frame->vp[i], 4) ||
+		    frame->vp[i][2] < 1 || frame->vp[i][2] > MAX_VP_SZ ||
+		    frame->vp[i][3] < 1 || frame->vp[i][3] > MAX_VP_SZ)
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Validates a surface record header and reads the pixels following it
+ * (if any), verifying them against the recorded checksum.
+ */
+static bool
+surf_read(hud_replay_t *replay, const hud_trace_surf_t *surf)
+{
+	size_t sz;
+
+	ASSERT(replay != NULL);
+	ASSERT(surf != NULL);
+
+	if (surf->w == 0 || surf->w > MAX_SURF_SZ ||
+	    surf->h == 0 || surf->h > MAX_SURF_SZ ||
+	    (surf->bpp != 1 && surf->bpp != 4) ||
+	    (surf->bpp == 1 && !floats_finite(surf->monochrome, 3)) ||
+	    (surf->has_pixels != 0 && surf->has_pixels != 1))
+		return (false);
+	if (!surf->has_pixels)
+		return (true);
+	sz = (size_t)surf->w * surf->h * surf->bpp;
+	if (sz > replay->pixels_cap) {
+		free(replay->pixels);
+		replay->pixels = safe_malloc(sz);
+		replay->pixels_cap = sz;
+	}
+	if (fread(replay->pixels, sz, 1, replay->fp) != 1 ||
+	    hud_trace_cksum(replay->pixels, sz) != surf->cksum)
+		return (false);
+	replay->surf = *surf;
+	replay->surf_new = true;
+	replay->has_pixels = true;
+
+	return (true);
+}
+
+/**
+ * Reads the next frame from a HUD trace. Any surface record preceding
+ * the frame is read as well and, if the trace was recorded with surface
+ * pixels, applied to the HUD by the next call to hud_replay_apply.
+ * Surface records trail the frames they belong to by a few frames (see
+ * hud_trace.h), so the replayed surface lags the recording by as much.
+ * Records which fail validation end the replay, so a corrupt trace
+ * never reaches the HUD.
+ *
+ * @return True if a frame was read into `frame', false when the end of
+ *	the trace has been reached (or the trace is truncated/corrupt).
+ */
+bool
+hud_replay_next(hud_replay_t *replay, hud_trace_frame_t *frame)
+{
+	uint32_t magic;
+
+	ASSERT(replay != NULL);
+	ASSERT(frame != NULL);
+
+	for (;;) {
+		if (fread(&magic, sizeof (magic), 1, replay->fp) != 1)
+			return (false);
+		VERIFY0(fseek(replay->fp, -(long)sizeof (magic), SEEK_CUR));
+		if (magic == HUD_TRACE_SURF_MAGIC) {
+			hud_trace_surf_t surf;
+
+			if (fread(&surf, sizeof (surf), 1, replay->fp) != 1)
+				return (false);
+			if (!surf_read(replay, &surf)) {
+				logMsg("HUD trace corrupt at surface record "
+				    "for frame %d", (int)surf.frame);
+				return (false);
+			}
+			continue;
+		}
+		if (fread(frame, sizeof (*frame), 1, replay->fp) != 1)
+			return (false);
+		if (!frame_valid(frame)) {
+			logMsg("HUD trace corrupt at frame record %d",
+			    (int)frame->frame);
+			return (false);
+		}
+		return (true);
+	}
+}
+
+/**
+ * @return True if any surface record read from the trace so far carried
+ *	surface pixels. Traces recorded without them (see hud_trace_start)
+ *	replay only the HUD parameters, not the symbology.
+ */
+bool
+hud_replay_has_pixels(const hud_replay_t *replay)
+{
+	ASSERT(replay != NULL);
+	return (replay->has_pixels);
+}
+
+/**
+ * Rewinds a HUD trace back to its first frame.
+ */
+void
+hud_replay_rewind(hud_replay_t *replay)
+{
+	ASSERT(replay != NULL);
+	VERIFY0(fseek(replay->fp, replay->data_off, SEEK_SET));
+	replay->surf_new = false;
+}
+
+/**
+ * Applies the HUD parameters recorded in a trace frame to a HUD object.
+ * If a surface record with pixels has been read since the previous
+ * frame, its contents are submitted using hud_surface_submit (enabling
+ * or resizing the libhud-owned surface as necessary). Traces recorded
+ * without surface pixels leave the HUD's surface untouched. Must be
+ * called from the render thread.
+ *
+ * @param replay The replay handle `frame' was read from.
+ *
+ * @return True on success, false if `frame' is invalid or the surface
+ *	couldn't be set up. The HUD is left unchanged in that case.
+ */
+bool
+hud_replay_apply(hud_replay_t *replay, hud_t *hud,
+    const hud_trace_frame_t *frame)
+{
+	ASSERT(replay != NULL);
+	ASSERT(hud != NULL);
+	ASSERT(frame != NULL);
+
+	if (!frame_valid(frame))
+		return (false);
+	if (replay->surf_new) {
+		const hud_trace_surf_t *surf = &replay->surf;
+		const hud_trace_surf_t *cur = &replay->surf_applied;
+
+		if (!hud_surface_is_enabled(hud) || cur->w != surf->w ||
+		    cur->h != surf->h || cur->bpp != surf->bpp ||
+		    memcmp(cur->monochrome, surf->monochrome,
+		    sizeof (cur->monochrome)) != 0) {
+			vect3_t mono = (surf->bpp == 1 ?
+			    VECT3(surf->monochrome[0], surf->monochrome[1],
+			    surf->monochrome[2]) : NULL_VECT3);
+
+			if (!hud_surface_enable(hud, surf->w, surf->h, mono))
+				return (false);
+			replay->surf_applied = *surf;
+		}
+		hud_surface_submit(hud, replay->pixels,
+		    (size_t)surf->w * surf->bpp, NULL, 0);
+		replay->surf_new = false;
+	}
+	hud_set_brightness(hud, frame->brt);
+	hud_set_glow(hud, frame->glow, frame->blur_radius,
+	    VECT3(frame->glow_color[0], frame->glow_color[1],
+	    frame->glow_color[2]));
+	hud_set_glass_opacity(hud, frame->glass_opacity);
+	hud_set_depth_test(hud, frame->depth_test);
+	hud_set_premultiplied(hud, frame->premul);
+	hud_set_surface_mips(hud, frame->surface_mips);
+	hud_set_stencil_scale(hud, frame->stencil_scale);
+	hud_set_gpu_budget(hud, frame->gpu_budget);
+
+	return (true);
+}
+
+/**
+ * Renders all eyes of a recorded trace frame into the currently bound
+ * framebuffer, reproducing the render state setup done by libhud's
+ * own draw callback.
+ */
+void
+hud_replay_render(hud_t *hud, const hud_trace_frame_t *frame)
+{
+	GLint saved_clip_origin, saved_depth_mode, saved_front_face;
+	GLint old_vp[4];
+
+	ASSERT(hud != NULL);
+	ASSERT(frame != NULL);
+
+	if (frame->rev_y) {
+		glGetIntegerv(GL_CLIP_ORIGIN, &saved_clip_origin);
+		glGetIntegerv(GL_CLIP_DEPTH_MODE, &saved_depth_mode);
+		glClipControl(GL_UPPER_LEFT, GL_ZERO_TO_ONE);
+		glGetIntegerv(GL_FRONT_FACE, &saved_front_face);
+		glFrontFace(GL_CCW);
+	}
+	glGetIntegerv(GL_VIEWPORT, old_vp);
+	for (unsigned i = 0; i < frame->num_eyes; i++) {
+		mat4 proj_mtx, acf_mtx, pvm;
+		vec4 vp;
+
+		memcpy(proj_mtx, frame->proj_mtx[i], sizeof (proj_mtx));
+		memcpy(acf_mtx, frame->acf_mtx[i], sizeof (acf_mtx));
+		memcpy(vp, frame->vp[i], sizeof (vp));
+		glm_mat4_mul(proj_mtx, acf_mtx, pvm);
+		glViewport(vp[0], vp[1], vp[2], vp[3]);
+		hud_render_eye(hud, pvm, vp);
+	}
+	glViewport(old_vp[0], old_vp[1], old_vp[2], old_vp[3]);
+	if (frame->rev_y) {
+		glClipControl(saved_clip_origin, saved_depth_mode);
+		glFrontFace(saved_front_face);
+	}
+}
+
+/**
+ * Computes the checksum of a block of surface pixels, as stored in
+ * hud_trace_surf_t.cksum.
+ */
+uint64_t
+hud_trace_cksum(const void *pixels, size_t len)
+{
+	ASSERT(pixels != NULL || len == 0);
+	crc64_init();
+	return (crc64(pixels, len));
+}
+
+/**
+ * Computes the checksum of the contents of a surface texture in the
+ * format of a hud_trace_surf_t record with the given `bpp', e.g. to
+ * verify a surface produced by a replay tool against a trace. This
+ * reads the texture back synchronously, so it stalls the GL pipeline.
+ * libhud itself doesn't use this while recording, it reads the surface
+ * back asynchronously instead.
+ */
+uint64_t
+hud_trace_tex_cksum(GLuint tex, unsigned w, unsigned h, unsigned bpp)
+{
+	uint8_t *buf;
+	uint64_t cksum;
+	GLint old_tex, old_align;
+
+	ASSERT(bpp == 1 || bpp == 4);
+	if (tex == 0 || w == 0 || h == 0)
+		return (0);
+
+	buf = safe_malloc((size_t)w * h * bpp);
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &old_tex);
+	glGetIntegerv(GL_PACK_ALIGNMENT, &old_align);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glGetTexImage(GL_TEXTURE_2D, 0, bpp == 1 ? GL_RED : GL_BGRA,
+	    GL_UNSIGNED_BYTE, buf);
+	glPixelStorei(GL_PACK_ALIGNMENT, old_align);
+	glBindTexture(GL_TEXTURE_2D, old_tex);
+	cksum = hud_trace_cksum(buf, (size_t)w * h * bpp);
+	free(buf);
+
+	return (cksum);
+}
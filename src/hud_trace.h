@@ -0,0 +1,122 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright 2021 Saso Kiselkov. All rights reserved.
+ */
+
+#ifndef	_HUD_TRACE_H_
+#define	_HUD_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libhud.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A HUD trace file consists of a single hud_trace_hdr_t, followed by any
+ * number of hud_trace_frame_t records, one per frame rendered while
+ * recording was active. Interspersed with these are hud_trace_surf_t
+ * records, which hold the checksum (and optionally the pixels) of the
+ * surface contents. Surface records are produced asynchronously, so one
+ * can follow the first frame record with the matching `surf_gen' by a
+ * few frames. If the surface changes faster than it can be read back,
+ * changes are coalesced, so not every `surf_gen' gets a surface record.
+ * All values are stored in host byte order and all reserved fields are
+ * zero.
+ */
+#define	HUD_TRACE_MAGIC		0x5254484cu	/* "LHTR" */
+#define	HUD_TRACE_FRAME_MAGIC	0x4d524648u	/* "HFRM" */
+#define	HUD_TRACE_SURF_MAGIC	0x46525348u	/* "HSRF" */
+#define	HUD_TRACE_VERSION	3
+
+typedef struct {
+	uint32_t	magic;		/* HUD_TRACE_MAGIC */
+	uint32_t	version;	/* HUD_TRACE_VERSION */
+} hud_trace_hdr_t;
+
+typedef struct {
+	uint32_t	magic;		/* HUD_TRACE_FRAME_MAGIC */
+	uint32_t	frame;		/* sequence number since trace start */
+	uint64_t	time_us;	/* microclock() at frame start */
+	uint8_t		num_eyes;
+	uint8_t		rev_y;
+	uint8_t		rev_float_z;
+	uint8_t		glow;
+	uint8_t		depth_test;
+	uint8_t		stencil_scale;
+	uint8_t		premul;
+	uint8_t		surface_mips;
+	float		fsaa_ratio[2];
+	float		brt;
+	float		blur_radius;
+	float		glow_color[3];
+	float		glass_opacity;
+	float		gpu_budget;
+	uint32_t	surf_w;
+	uint32_t	surf_h;
+	uint32_t	reserved;
+	uint64_t	surf_gen;	/* see hud_trace_surf_t */
+	/* Matrices & viewports exactly as passed to hud_render_eye */
+	float		proj_mtx[2][16];
+	float		acf_mtx[2][16];
+	float		vp[2][4];
+} hud_trace_frame_t;
+
+/*
+ * If `has_pixels' is set, this is followed by `h' rows of `w' * `bpp'
+ * bytes of pixels, top row first. With a `bpp' of 4, the pixels are
+ * premultiplied BGRA, otherwise they are 8-bit intensity values tinted
+ * using `monochrome'. This is the format taken by hud_surface_enable &
+ * hud_surface_submit. Pixels are only recorded on request, see
+ * hud_trace_start.
+ */
+typedef struct {
+	uint32_t	magic;		/* HUD_TRACE_SURF_MAGIC */
+	uint32_t	frame;		/* frame the surface was read back in */
+	uint32_t	w;
+	uint32_t	h;
+	uint32_t	bpp;		/* 1 or 4 */
+	float		monochrome[3];
+	uint64_t	gen;		/* hud_trace_frame_t.surf_gen */
+	uint64_t	cksum;		/* crc64 of the pixels */
+	uint32_t	has_pixels;
+	uint32_t	reserved;
+} hud_trace_surf_t;
+
+typedef struct hud_replay_s hud_replay_t;
+
+hud_replay_t *hud_replay_open(const char *filename);
+void hud_replay_close(hud_replay_t *replay);
+bool hud_replay_next(hud_replay_t *replay, hud_trace_frame_t *frame);
+void hud_replay_rewind(hud_replay_t *replay);
+bool hud_replay_has_pixels(const hud_replay_t *replay);
+
+bool hud_replay_apply(hud_replay_t *replay, hud_t *hud,
+    const hud_trace_frame_t *frame);
+void hud_replay_render(hud_t *hud, const hud_trace_frame_t *frame);
+
+uint64_t hud_trace_cksum(const void *pixels, size_t len);
+uint64_t hud_trace_tex_cksum(GLuint tex, unsigned w, unsigned h,
+    unsigned bpp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _HUD_TRACE_H_ */
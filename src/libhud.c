@@ -16,15 +16,23 @@
  * Copyright 2021 Saso Kiselkov. All rights reserved.
  */
 
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
 #include <XPLMDisplay.h>
 #include <XPLMGraphics.h>
 
 #include <acfutils/dr.h>
+#include <acfutils/geom.h>
 #include <acfutils/glew.h>
 #include <acfutils/glutils.h>
 #include <acfutils/helpers.h>
 #include <acfutils/safe_alloc.h>
 #include <acfutils/shader.h>
+#include <acfutils/thread.h>
 #include <acfutils/time.h>
 
 #ifdef	LIBHUD_USE_LIBDRAWCB
@@ -36,6 +44,7 @@
 	XPLMUnregisterDrawCallback((__cb), (__phase), (__before), (__refcon))
 #endif	/* !defined(LIBHUD_USE_LIBDRAWCB) */
 
+#include "hud_trace.h"
 #include "libhud.h"
 
 #if	!APL
@@ -76,25 +85,97 @@ typedef enum {
 } world_render_type_t;
 
 TEXSZ_MK_TOKEN(hud_glass_tex);
+TEXSZ_MK_TOKEN(hud_flat_tex);
+TEXSZ_MK_TOKEN(hud_mip_tex);
+TEXSZ_MK_TOKEN(hud_surf_tex);
+TEXSZ_MK_TOKEN(hud_surf_pbo);
+TEXSZ_MK_TOKEN(hud_readback_tex);
+TEXSZ_MK_TOKEN(hud_readback_pbo);
+TEXSZ_MK_TOKEN(hud_trace_pbo);
+
+/*
+ * Counters & timed trace zones. Both compile down to nothing unless
+ * libhud is built with LIBHUD_STATS defined (except for the GPU time,
+ * see gov_collect). A zone is opened with ZONE_BEGIN(name) and closed
+ * in the same scope with ZONE_END(hud, name), which accumulates the
+ * elapsed CPU time into hud->stats.<name>_us and reports the zone to
+ * the user's trace callback (if any).
+ */
+#ifdef	LIBHUD_STATS
+#define	STAT_ADD(hud, field, n)	do { (hud)->stats.field += (n); } while (0)
+#define	STAT_INC(hud, field)	STAT_ADD(hud, field, 1)
+#define	ZONE_BEGIN(zone) \
+	const uint64_t zone ## _zone_start = microclock()
+#define	ZONE_END(hud, zone) \
+	zone_end((hud), "hud_" #zone, zone ## _zone_start, \
+	    &(hud)->stats.zone ## _us)
+#else	/* !defined(LIBHUD_STATS) */
+#define	STAT_ADD(hud, field, n)	do { } while (0)
+#define	STAT_INC(hud, field)	do { } while (0)
+#define	ZONE_BEGIN(zone)	do { } while (0)
+#define	ZONE_END(hud, zone)	do { } while (0)
+#endif	/* !defined(LIBHUD_STATS) */
 
+/*
+ * proj.frag is specialized into permutations identified by a key made
+ * up of these feature bits. A key of 0 is the RGBA no-glow shader. Each
+ * permutation is only specialized & linked the first time it is
+ * actually needed (see proj_shader_get).
+ */
+#define	PROJ_GLOW		(1u << 0)
+#define	PROJ_GLOW_LQ		(1u << 1)	/* only with PROJ_GLOW */
+#define	PROJ_MONO		(1u << 2)
+#define	PROJ_PREMUL		(1u << 3)
+#define	PROJ_MIPS		(1u << 4)
+#define	PROJ_REPROJ		(1u << 5)
+#define	NUM_PROJ_SHADERS	(1u << 6)
+
+/* Specialization constant IDs in proj.frag */
 enum {
-    PROJ_SHADER_GLOW,
-    PROJ_SHADER_NOGLOW,
-    PROJ_SHADER_MONO_GLOW,
-    PROJ_SHADER_MONO_NOGLOW,
-    NUM_PROJ_SHADERS
+    PROJ_SPEC_GLOW = 0,
+    PROJ_SPEC_MONOCHROME = 1,
+    PROJ_SPEC_PREMULTIPLIED = 2,
+    PROJ_SPEC_MIPMAPPED = 3,
+    PROJ_SPEC_REPROJECT = 4
 };
 
+/*
+ * Frame-time governor tunables. GPU time is measured using timestamp
+ * queries kept in a small ring, so results are only ever collected once
+ * the GPU has made them available - we never stall waiting on them.
+ * The smoothed per-frame time must stay over budget for GOV_DEGRADE_SAMPLES
+ * to step down a quality level, and under GOV_RECOVER_FRAC of the budget
+ * for the recovery hold time to step back up. If we have to degrade again
+ * shortly after recovering, the hold time is doubled to avoid oscillating
+ * between two levels.
+ */
+#define	GOV_QUERY_RING		8
+#define	GOV_EMA_ALPHA		0.1
+#define	GOV_DEGRADE_SAMPLES	10
+#define	GOV_RECOVER_FRAC	0.6
+#define	GOV_RECOVER_SAMPLES	120
+#define	GOV_RECOVER_SAMPLES_MAX	(GOV_RECOVER_SAMPLES * 16)
+/* Lowest level the governor steps into on its own */
+#define	GOV_MAX_LEVEL		HUD_QUALITY_STENCIL_HALF
+
+#define	MAX_STENCIL_SCALE	8
+#define	MAX_FLAT_CACHE_SCALE	4
+#define	SURF_TILE		64	/* dirty tracking granularity, px */
+#define	SURF_NUM_BUFS		3	/* see surf_t */
+
+/*
+ * Async readback tunables. RB_NUM_PBOS frames can be in flight on the
+ * GPU, queued to, or held by the consumer. When they run out, the frame
+ * is dropped rather than waited on.
+ */
+#define	RB_NUM_PBOS		4
+
+/* Set in hud_t.params.mid when the buffer hasn't been picked up yet */
+#define	PARAMS_FRESH		0x4u
+
 static shader_info_t generic_vert_info = { .filename = "generic.vert.spv" };
 static shader_info_t stencil_frag_info = { .filename = "stencil.frag.spv" };
 static shader_info_t glass_frag_info = { .filename = "glass.frag.spv" };
-static shader_info_t proj_frag_info[NUM_PROJ_SHADERS] = {
-    [PROJ_SHADER_GLOW] = { .filename = "proj_glow.frag.spv" },
-    [PROJ_SHADER_NOGLOW] = { .filename = "proj_noglow.frag.spv" },
-    [PROJ_SHADER_MONO_GLOW] = { .filename = "proj_mono_glow.frag.spv" },
-    [PROJ_SHADER_MONO_NOGLOW] = { .filename = "proj_mono_noglow.frag.spv" }
-};
-
 static shader_prog_info_t glass_prog_info = {
     .progname = "libhud_glass",
     .vert = &generic_vert_info,
@@ -107,40 +188,109 @@ static shader_prog_info_t stencil_prog_info = {
     .frag = &stencil_frag_info
 };
 
-static shader_prog_info_t proj_prog_info[NUM_PROJ_SHADERS] = {
-    [PROJ_SHADER_GLOW] = {
-	.progname = "libhud_proj_glow",
-	.vert = &generic_vert_info,
-	.frag = &proj_frag_info[PROJ_SHADER_GLOW]
-    },
-    [PROJ_SHADER_NOGLOW] = {
-	.progname = "libhud_proj_noglow",
-	.vert = &generic_vert_info,
-	.frag = &proj_frag_info[PROJ_SHADER_NOGLOW]
-    },
-    [PROJ_SHADER_MONO_GLOW] = {
-	.progname = "libhud_proj_mono_glow",
-	.vert = &generic_vert_info,
-	.frag = &proj_frag_info[PROJ_SHADER_MONO_GLOW]
-    },
-    [PROJ_SHADER_MONO_NOGLOW] = {
-	.progname = "libhud_proj_mono_noglow",
-	.vert = &generic_vert_info,
-	.frag = &proj_frag_info[PROJ_SHADER_MONO_NOGLOW]
-    }
-};
+/* A specialized permutation of proj.frag, see proj_shader_get */
+typedef struct {
+	GLuint		prog;
+	GLint		pvm;
+	GLint		surf_tex;
+	GLint		surf_sz;
+	GLint		stencil_tex;
+	GLint		stencil_sz;
+	GLint		vp;
+	GLint		brt;
+	GLint		blur_radius;
+	GLint		beam_color;
+	GLint		uv_xform;
+	bool		failed;
+} proj_shader_t;
 
-struct hud_s {
-	char			*shader_dir;
+/*
+ * User-settable parameters which are consumed by the renderer. These
+ * can be changed from any thread, so they are published to the render
+ * thread through a triple buffer (see params_publish & params_latch).
+ */
+typedef struct {
 	mt_cairo_render_t	*mtcr;
-	bool			enabled;
-	bool			rev_y;
-	bool			rev_float_z;
 	float			brt;
 	bool			glow;
 	float			blur_radius;
-	bool			depth_test;
 	vect3_t			glow_color;
+	double			glass_opacity;
+	bool			depth_test;
+	bool			premul;
+	bool			surface_mips;
+	unsigned		stencil_scale;
+	double			gpu_budget;
+	size_t			mem_budget;
+} hud_params_t;
+
+/*
+ * A libhud-owned surface, triple buffered. A producer claims the surface
+ * by setting `staging', stages new contents into buffer `back' using
+ * surf_submit and then publishes them all at once by making `back' the
+ * new `front'. The render thread pins `front' while it uploads the tiles
+ * which changed from it (see surf_upload), so it never sees a partial
+ * submission. `lock' is only ever held to swap buffer indices & flags,
+ * all pixel comparisons & copies are done with it released, so neither
+ * side ever waits on the other's copying.
+ */
+typedef struct {
+	/* Only changed on the render thread, under lock & not staging */
+	bool		enabled;
+	unsigned	w;
+	unsigned	h;
+	unsigned	bpp;
+	vect3_t		monochrome;
+	unsigned	tiles_x;
+	unsigned	tiles_y;
+	uint8_t		*buf[SURF_NUM_BUFS];
+	/* Render thread only */
+	GLuint		tex;
+	GLuint		pbo;
+	uint64_t	gen;		/* incremented on every upload */
+	unsigned	*upload;	/* tiles being uploaded */
+	vect3_t		tex_att;	/* `att' of the texture contents */
+	/* Only used by the submitter which has set `staging' */
+	bool		*stale[SURF_NUM_BUFS];	/* per tile, out of date */
+	bool		*back_dirty;	/* per tile, changed in `back' */
+	unsigned	*back_tiles;	/* list of tiles changed in `back' */
+	unsigned	back_num;
+	/* Everything below is protected by lock */
+	mutex_t		lock;
+	condvar_t	cv;		/* signaled when `staging' clears */
+	bool		staging;	/* a submission is in progress */
+	unsigned	back;		/* buffer being staged into */
+	unsigned	front;		/* latest complete submission */
+	unsigned	pinned;		/* being uploaded, or SURF_NUM_BUFS */
+	bool		*dirty;		/* per tile, not yet uploaded */
+	unsigned	num_dirty;
+	vect3_t		att;		/* attitude `front' was rendered at */
+} surf_t;
+
+/* A record queued for the trace writer, see trace_writer */
+typedef struct trace_rec_s {
+	struct trace_rec_s	*next;
+	const uint8_t		*pixels;	/* surface records only */
+	size_t			len;
+	uint8_t			data[];
+} trace_rec_t;
+
+struct hud_s {
+	char			*shader_dir;
+	bool			enabled;
+	bool			rev_y;
+	bool			rev_float_z;
+
+	struct {
+		mutex_t		lock;	/* serializes writers */
+		hud_params_t	cur;	/* latest values, protected by lock */
+		hud_params_t	buf[3];
+		unsigned	back;	/* protected by lock */
+		atomic_uint	mid;	/* buffer index | PARAMS_FRESH */
+		unsigned	front;	/* render thread only */
+	} params;
+	/* Consistent snapshot of params for the current frame */
+	const hud_params_t	*snap;
 
 	struct {
 		GLuint		prog;
@@ -151,26 +301,13 @@ struct hud_s {
 		GLint		pvm;
 		GLint		opacity;
 	} glass_shader;
-	struct {
-		GLuint		prog;
-		GLint		pvm;
-		GLint		surf_tex;
-		GLint		surf_sz;
-		GLint		stencil_tex;
-		GLint		stencil_sz;
-		GLint		vp;
-		GLint		brt;
-		GLint		blur_radius;
-		GLint		beam_color;
-	} proj_shader[NUM_PROJ_SHADERS];
+	proj_shader_t		proj_shader[NUM_PROJ_SHADERS];
 
 	GLuint			stencil_fbo;
 	GLuint			stencil_tex;
-	GLuint			stencil_depth_rbo;
 	int			stencil_w;
 	int			stencil_h;
 
-	double			glass_opacity;
 	obj8_t			*glass;
 	char			*glass_group;
 	obj8_t			*proj;
@@ -180,6 +317,7 @@ struct hud_s {
 	mat4			proj_mtx[2];
 	mat4			acf_mtx[2];
 	vec4			vp[2];
+	vect2_t			fsaa_ratio;
 	struct {
 		dr_t		old_fbo;
 		dr_t		world_render_type;
@@ -190,12 +328,277 @@ struct hud_s {
 		dr_t		vp;
 		dr_t		rev_y;
 		dr_t		rev_float_z;
+		dr_t		theta;
+		dr_t		phi;
+		dr_t		psi;
 		bool		aa_ratio_avail;
 		dr_t		fsaa_ratio_x;
 		dr_t		fsaa_ratio_y;
 	} drs;
+
+	struct {
+		double		budget;		/* ms, 0 = governor off */
+		hud_quality_t	level;
+		double		eye_time;	/* smoothed, ms */
+		unsigned	over;
+		unsigned	under;
+		unsigned	recover_hold;
+		unsigned	since_recover;
+		unsigned	next_query;
+		/* over budget at GOV_MAX_LEVEL, see hud_get_quality */
+		bool		surface_hint;
+		struct {
+			GLuint	q[2];		/* start & end timestamps */
+			bool	pending;
+		} queries[GOV_QUERY_RING];
+	} gov;
+
+	/*
+	 * Conformal layer (see hud_conformal_enable). `active' and
+	 * `uv_xform' are set up once per frame by conf_update.
+	 */
+	struct {
+		surf_t		surf;
+		double		px_per_deg;
+		vect2_t		center;		/* boresight, surface px */
+		bool		active;
+		mat3		uv_xform;
+	} conf;
+
+	/*
+	 * Mipmapped copy of the mtcr surface (see surface_tex_get),
+	 * refreshed whenever mtcr swaps in a new texture.
+	 */
+	struct {
+		GLuint		tex;
+		GLuint		fbo[2];		/* read (src) & draw (tex) */
+		unsigned	w;
+		unsigned	h;
+		bool		mono;
+		size_t		bytes;
+		uint64_t	src_gen;	/* see src.gen */
+	} mip;
+
+	/*
+	 * libhud-owned surface, used instead of the mtcr surface while
+	 * enabled (see surf_t).
+	 */
+	surf_t			surf;
+
+	/*
+	 * Surface source generation, incremented at most once per frame
+	 * by src_update when the surface contents may have changed. The
+	 * textures we derive from the surface (mips, flat cache) are
+	 * keyed on this, rather than on the texture name.
+	 */
+	struct {
+		uint64_t		gen;
+		GLuint			tex;
+		const mt_cairo_render_t	*mtcr;
+		uint64_t		surf_gen;
+	} src;
+
+	/* Resources for rendering the projection flat into a 2D rect */
+	struct {
+		GLuint		white_tex;	/* 1x1 no-op stencil */
+		glutils_quads_t	quad;
+		bool		inited;
+		/*
+		 * Cached composite of the glow & main passes at full
+		 * brightness, so a flat render with glow is one draw.
+		 * Invalidated when any of the cache_* inputs change.
+		 */
+		GLuint		cache_fbo;
+		GLuint		cache_tex;
+		unsigned	cache_w;	/* source surface size */
+		unsigned	cache_h;
+		unsigned	cache_tex_w;	/* actual cache size */
+		unsigned	cache_tex_h;
+		uint64_t	cache_src_gen;	/* see src.gen */
+		unsigned	cache_glow_key;
+		float		cache_blur_radius;
+		vect3_t		cache_glow_color;
+		vect3_t		cache_monochrome;
+	} flat;
+
+	struct {
+		bool		enabled;
+		unsigned	w;
+		unsigned	h;
+		GLuint		fbo;
+		GLuint		tex;
+		uint64_t	frame;
+		unsigned	pbo_head;	/* next PBO to issue into */
+		unsigned	pbo_tail;	/* oldest PBO in flight */
+		struct {
+			GLuint	pbo;
+			GLsync	fence;		/* in flight on the GPU */
+			uint64_t frame;
+			/* persistent mapping, or `copy' */
+			const uint8_t *pixels;
+			/* only without ARB_buffer_storage */
+			uint8_t	*copy;
+		} pbos[RB_NUM_PBOS];
+
+		hud_readback_cb_t cb;
+		void		*userinfo;
+		thread_t	worker;
+		/* Everything below is protected by lock */
+		mutex_t		lock;
+		condvar_t	cv;
+		bool		shutdown;
+		bool		busy[RB_NUM_PBOS];	/* queued or consumed */
+		/* FIFO of indices into pbos */
+		unsigned	queue[RB_NUM_PBOS];
+		unsigned	q_head;
+		unsigned	q_len;
+	} rb;
+
+	struct {
+		FILE		*fp;		/* written by `writer' only */
+		bool		pixels;		/* record surface pixels */
+		uint32_t	frame;
+		uint64_t	src_gen;	/* see src.gen */
+		/*
+		 * Surface readback, see trace_surf_start. `pbo_map' is
+		 * the persistent mapping, or NULL if we have to copy the
+		 * PBO into `copy' for the writer.
+		 */
+		GLuint		pbo;
+		size_t		pbo_sz;
+		const uint8_t	*pbo_map;
+		uint8_t		*copy;
+		GLsync		fence;		/* in flight on the GPU */
+		hud_trace_surf_t surf;
+
+		thread_t	writer;
+		/* Everything below is protected by lock */
+		mutex_t		lock;
+		condvar_t	cv;
+		bool		shutdown;
+		bool		failed;		/* write error, stop tracing */
+		bool		pbo_busy;	/* queued or being written */
+		trace_rec_t	*q_head;
+		trace_rec_t	*q_tail;
+	} trace;
+
+	hud_stats_t		stats;
+	hud_trace_cb_t		trace_cb;
+	void			*trace_userinfo;
 };
 
+static void render_eye(hud_t *hud, const mat4 pvm, const vec4 vp);
+static void mip_free(hud_t *hud);
+static bool proj_shaders_prepare(hud_t *hud);
+static GLuint surf_tex_raw(const hud_t *hud);
+static vect2_t surf_size(const hud_t *hud);
+static vect3_t surf_monochrome(const hud_t *hud);
+static void frame_begin(hud_t *hud);
+static void surf_init(surf_t *surf);
+static void surf_fini(surf_t *surf);
+
+/*
+ * Copies the writers' current parameter values into the back buffer and
+ * swaps it with the middle buffer, flagging it as fresh for the render
+ * thread to pick up. Must be called with params.lock held.
+ */
+static void
+params_publish(hud_t *hud)
+{
+	unsigned old_mid;
+
+	ASSERT(hud != NULL);
+
+	hud->params.buf[hud->params.back] = hud->params.cur;
+	old_mid = atomic_exchange(&hud->params.mid,
+	    hud->params.back | PARAMS_FRESH);
+	hud->params.back = (old_mid & ~PARAMS_FRESH);
+}
+
+/*
+ * Called by the render thread once per frame to grab the most recently
+ * published parameter values. This never blocks: if a fresh buffer is
+ * available, we simply swap our front buffer with it.
+ */
+static void
+params_latch(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+
+	if (atomic_load_explicit(&hud->params.mid, memory_order_relaxed) &
+	    PARAMS_FRESH) {
+		unsigned old_mid = atomic_exchange(&hud->params.mid,
+		    hud->params.front);
+		hud->params.front = (old_mid & ~PARAMS_FRESH);
+	}
+	hud->snap = &hud->params.buf[hud->params.front];
+}
+
+static hud_params_t *
+params_enter(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	mutex_enter(&hud->params.lock);
+	return (&hud->params.cur);
+}
+
+static void
+params_exit(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	params_publish(hud);
+	mutex_exit(&hud->params.lock);
+}
+
+/**
+ * Returns true while parameter changes made using any of the hud_set_*
+ * functions haven't been picked up by the render thread yet. Once this
+ * returns false, the latest changes have been latched by the render
+ * thread as of its last frame or render call (the draw callback,
+ * hud_render_eye and hud_render_flat each latch the parameters at
+ * their start). A previously set mt_cairo_render instance can then be
+ * destroyed, as no render call latches it again. Please note that if
+ * the HUD isn't being rendered, changes stay pending indefinitely (but
+ * nothing references the old values either).
+ */
+bool
+hud_params_pending(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return ((atomic_load(&hud->params.mid) & PARAMS_FRESH) != 0);
+}
+
+static hud_params_t
+params_get(const hud_t *hud)
+{
+	hud_params_t params;
+	/* The lock is logically not part of the object's state */
+	mutex_t *lock = (mutex_t *)&hud->params.lock;
+
+	ASSERT(hud != NULL);
+	mutex_enter(lock);
+	params = hud->params.cur;
+	mutex_exit(lock);
+
+	return (params);
+}
+
+#ifdef	LIBHUD_STATS
+static void
+zone_end(hud_t *hud, const char *zone, uint64_t start, uint64_t *total)
+{
+	uint64_t now = microclock();
+
+	ASSERT(hud != NULL);
+	ASSERT(zone != NULL);
+	ASSERT(total != NULL);
+
+	*total += now - start;
+	if (hud->trace_cb != NULL)
+		hud->trace_cb(zone, start, now, hud->trace_userinfo);
+}
+#endif	/* defined(LIBHUD_STATS) */
+
 static void
 capture_mtx_common(hud_t *hud, unsigned idx, int dct)
 {
@@ -219,6 +622,7 @@ capture_mtx_common(hud_t *hud, unsigned idx, int dct)
 	 */
 	if (dct == DRAW_CALL_RIGHT_EYE && vp[0] == 0)
 		vp[0] += vp[2];
+	STAT_ADD(hud, dr_reads, 5);
 	for (int i = 0; i < 4; i++)
 		hud->vp[idx][i] = vp[i];
 	hud->rev_y = (dr_geti(&hud->drs.rev_y) != 0);
@@ -237,6 +641,8 @@ capture_mtx_common(hud_t *hud, unsigned idx, int dct)
 	if (hud->drs.aa_ratio_avail) {
 		vect2_t fsaa_ratio = VECT2(dr_getf(&hud->drs.fsaa_ratio_x),
 		    dr_getf(&hud->drs.fsaa_ratio_y));
+		STAT_ADD(hud, dr_reads, 2);
+		hud->fsaa_ratio = fsaa_ratio;
 		if (fsaa_ratio.x >= 1 && fsaa_ratio.y >= 1) {
 			hud->vp[idx][0] /= fsaa_ratio.x;
 			hud->vp[idx][1] /= fsaa_ratio.y;
@@ -247,6 +653,304 @@ capture_mtx_common(hud_t *hud, unsigned idx, int dct)
 #endif	/* !defined(APL) */
 }
 
+/*
+ * Trace writer thread. All trace file I/O happens here, so recording
+ * never blocks the render thread on the disk. Records are handed over
+ * through a FIFO of trace_rec_t. Surface records also carry a pointer
+ * to the read back pixels, which the writer checksums and (if pixel
+ * recording is enabled) writes out, before handing the PBO back to the
+ * render thread by clearing `pbo_busy'.
+ */
+static void
+trace_writer(void *arg)
+{
+	hud_t *hud = arg;
+
+	ASSERT(hud != NULL);
+	thread_set_name("hud_trace");
+
+	mutex_enter(&hud->trace.lock);
+	for (;;) {
+		trace_rec_t *rec;
+		bool ok;
+
+		while (hud->trace.q_head == NULL && !hud->trace.shutdown)
+			cv_wait(&hud->trace.cv, &hud->trace.lock);
+		rec = hud->trace.q_head;
+		if (rec == NULL)
+			break;
+		hud->trace.q_head = rec->next;
+		if (hud->trace.q_head == NULL)
+			hud->trace.q_tail = NULL;
+		mutex_exit(&hud->trace.lock);
+
+		if (rec->pixels != NULL) {
+			hud_trace_surf_t *surf = (hud_trace_surf_t *)rec->data;
+			size_t sz = (size_t)surf->w * surf->h * surf->bpp;
+
+			ASSERT3U(rec->len, ==, sizeof (*surf));
+			surf->cksum = hud_trace_cksum(rec->pixels, sz);
+			ok = (fwrite(surf, sizeof (*surf), 1,
+			    hud->trace.fp) == 1 && (!surf->has_pixels ||
+			    fwrite(rec->pixels, sz, 1, hud->trace.fp) == 1));
+		} else {
+			ok = (fwrite(rec->data, rec->len, 1,
+			    hud->trace.fp) == 1);
+		}
+
+		mutex_enter(&hud->trace.lock);
+		if (rec->pixels != NULL)
+			hud->trace.pbo_busy = false;
+		if (!ok && !hud->trace.failed) {
+			logMsg("Error writing HUD trace: %s",
+			    strerror(errno));
+			hud->trace.failed = true;
+		}
+		free(rec);
+	}
+	mutex_exit(&hud->trace.lock);
+}
+
+/*
+ * Queues a record for the trace writer. `pixels' is only set for
+ * surface records, see trace_writer.
+ */
+static void
+trace_enqueue(hud_t *hud, const void *data, size_t len,
+    const uint8_t *pixels)
+{
+	trace_rec_t *rec = safe_malloc(sizeof (*rec) + len);
+
+	ASSERT(hud != NULL);
+	rec->next = NULL;
+	rec->len = len;
+	rec->pixels = pixels;
+	memcpy(rec->data, data, len);
+
+	mutex_enter(&hud->trace.lock);
+	if (pixels != NULL) {
+		ASSERT(!hud->trace.pbo_busy);
+		hud->trace.pbo_busy = true;
+	}
+	if (hud->trace.q_tail != NULL)
+		hud->trace.q_tail->next = rec;
+	else
+		hud->trace.q_head = rec;
+	hud->trace.q_tail = rec;
+	cv_broadcast(&hud->trace.cv);
+	mutex_exit(&hud->trace.lock);
+}
+
+/*
+ * Hands a finished surface readback to the trace writer. Never waits on
+ * the GPU: if the readback hasn't finished yet, we try again on the
+ * next frame. With a persistently mapped PBO, the writer reads the
+ * mapping directly. Otherwise we have to map the PBO here and copy it
+ * out, as the writer has no GL context.
+ */
+static void
+trace_surf_collect(hud_t *hud)
+{
+	GLenum res;
+	const uint8_t *pixels = hud->trace.pbo_map;
+
+	ASSERT(hud != NULL);
+
+	if (hud->trace.fence == NULL)
+		return;
+	res = glClientWaitSync(hud->trace.fence, 0, 0);
+	if (res != GL_ALREADY_SIGNALED && res != GL_CONDITION_SATISFIED)
+		return;
+	glDeleteSync(hud->trace.fence);
+	hud->trace.fence = NULL;
+
+	if (pixels == NULL) {
+		const void *map;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, hud->trace.pbo);
+		map = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+		    hud->trace.pbo_sz, GL_MAP_READ_BIT);
+		if (map != NULL) {
+			memcpy(hud->trace.copy, map, hud->trace.pbo_sz);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			pixels = hud->trace.copy;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (pixels == NULL)
+			return;
+	}
+	trace_enqueue(hud, &hud->trace.surf, sizeof (hud->trace.surf),
+	    pixels);
+}
+
+/*
+ * (Re)creates the trace PBO with a size of `sz' bytes. Where possible,
+ * the PBO stays mapped for its whole lifetime, as with the readback
+ * PBOs (see hud_readback_enable).
+ */
+static void
+trace_pbo_alloc(hud_t *hud, size_t sz)
+{
+	const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT |
+	    GL_MAP_COHERENT_BIT;
+
+	ASSERT(hud != NULL);
+	ASSERT(hud->trace.fence == NULL);
+	ASSERT(!hud->trace.pbo_busy);
+
+	if (hud->trace.pbo != 0) {
+		glDeleteBuffers(1, &hud->trace.pbo);
+		IF_TEXSZ(TEXSZ_FREE_BYTES(hud_trace_pbo, hud->trace.pbo_sz));
+	}
+	free(hud->trace.copy);
+	hud->trace.copy = NULL;
+	hud->trace.pbo_map = NULL;
+	hud->trace.pbo_sz = sz;
+
+	glGenBuffers(1, &hud->trace.pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, hud->trace.pbo);
+	IF_TEXSZ(TEXSZ_ALLOC_BYTES(hud_trace_pbo, sz));
+	if (GLEW_ARB_buffer_storage) {
+		glBufferStorage(GL_PIXEL_PACK_BUFFER, sz, NULL, flags);
+		hud->trace.pbo_map = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+		    sz, flags);
+	} else {
+		glBufferData(GL_PIXEL_PACK_BUFFER, sz, NULL, GL_STREAM_READ);
+	}
+	if (hud->trace.pbo_map == NULL)
+		hud->trace.copy = safe_malloc(sz);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+/*
+ * Starts an asynchronous readback of the current surface contents into
+ * the trace PBO, to be collected by trace_surf_collect on a later
+ * frame. Only one readback is in flight at a time. If the previous one
+ * is still on the GPU or with the writer, this returns false and the
+ * caller retries on the next frame, so surface changes in the meantime
+ * are coalesced.
+ */
+static bool
+trace_surf_start(hud_t *hud)
+{
+	hud_trace_surf_t *surf;
+	GLuint tex;
+	vect2_t sz;
+	vect3_t mono;
+	GLint old_align;
+	bool busy;
+
+	ASSERT(hud != NULL);
+
+	mutex_enter(&hud->trace.lock);
+	busy = hud->trace.pbo_busy;
+	mutex_exit(&hud->trace.lock);
+	if (hud->trace.fence != NULL || busy)
+		return (false);
+
+	tex = surf_tex_raw(hud);
+	sz = surf_size(hud);
+	mono = surf_monochrome(hud);
+	if (tex == 0 || sz.x == 0 || sz.y == 0)
+		return (true);	/* nothing to show yet */
+
+	surf = &hud->trace.surf;
+	memset(surf, 0, sizeof (*surf));
+	surf->magic = HUD_TRACE_SURF_MAGIC;
+	surf->frame = hud->trace.frame;
+	surf->w = sz.x;
+	surf->h = sz.y;
+	surf->bpp = (IS_NULL_VECT(mono) ? 4 : 1);
+	if (!IS_NULL_VECT(mono)) {
+		surf->monochrome[0] = mono.x;
+		surf->monochrome[1] = mono.y;
+		surf->monochrome[2] = mono.z;
+	}
+	surf->gen = hud->src.gen;
+	surf->has_pixels = hud->trace.pixels;
+
+	if ((size_t)surf->w * surf->h * surf->bpp != hud->trace.pbo_sz)
+		trace_pbo_alloc(hud, (size_t)surf->w * surf->h * surf->bpp);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, hud->trace.pbo);
+	glGetIntegerv(GL_PACK_ALIGNMENT, &old_align);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	XPLMBindTexture2d(tex, 0);
+	glGetTexImage(GL_TEXTURE_2D, 0, surf->bpp == 1 ? GL_RED : GL_BGRA,
+	    GL_UNSIGNED_BYTE, NULL);
+	XPLMBindTexture2d(0, 0);
+	glPixelStorei(GL_PACK_ALIGNMENT, old_align);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	hud->trace.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	return (true);
+}
+
+/*
+ * Appends the current frame's captured matrices, viewports & parameters
+ * to the trace, along with a surface readback if the surface changed.
+ * Only called while trace recording is active.
+ */
+static void
+trace_frame(hud_t *hud)
+{
+	hud_trace_frame_t frame;
+	const hud_params_t *params;
+	bool failed;
+
+	ASSERT(hud != NULL);
+	ASSERT(hud->trace.fp != NULL);
+	params = hud->snap;
+
+	mutex_enter(&hud->trace.lock);
+	failed = hud->trace.failed;
+	mutex_exit(&hud->trace.lock);
+	if (failed) {
+		logMsg("Stopping HUD trace due to write errors");
+		hud_trace_stop(hud);
+		return;
+	}
+
+	trace_surf_collect(hud);
+	if (hud->trace.frame == 0 || hud->src.gen != hud->trace.src_gen) {
+		if (trace_surf_start(hud))
+			hud->trace.src_gen = hud->src.gen;
+	}
+
+	/* Written out as is, so the padding must not be left undefined */
+	memset(&frame, 0, sizeof (frame));
+	frame.magic = HUD_TRACE_FRAME_MAGIC;
+	frame.time_us = microclock();
+	frame.frame = hud->trace.frame++;
+	frame.num_eyes = hud->num_eyes;
+	frame.rev_y = hud->rev_y;
+	frame.rev_float_z = hud->rev_float_z;
+	frame.glow = params->glow;
+	frame.depth_test = params->depth_test;
+	frame.premul = params->premul;
+	frame.surface_mips = params->surface_mips;
+	frame.stencil_scale = params->stencil_scale;
+	frame.fsaa_ratio[0] = hud->fsaa_ratio.x;
+	frame.fsaa_ratio[1] = hud->fsaa_ratio.y;
+	frame.brt = params->brt;
+	frame.blur_radius = params->blur_radius;
+	frame.glow_color[0] = params->glow_color.x;
+	frame.glow_color[1] = params->glow_color.y;
+	frame.glow_color[2] = params->glow_color.z;
+	frame.glass_opacity = params->glass_opacity;
+	frame.gpu_budget = params->gpu_budget;
+	frame.surf_w = surf_size(hud).x;
+	frame.surf_h = surf_size(hud).y;
+	frame.surf_gen = hud->src.gen;
+	for (unsigned i = 0; i < hud->num_eyes; i++) {
+		memcpy(frame.proj_mtx[i], hud->proj_mtx[i],
+		    sizeof (frame.proj_mtx[i]));
+		memcpy(frame.acf_mtx[i], hud->acf_mtx[i],
+		    sizeof (frame.acf_mtx[i]));
+		memcpy(frame.vp[i], hud->vp[i], sizeof (frame.vp[i]));
+	}
+	trace_enqueue(hud, &frame, sizeof (frame), NULL);
+}
+
 #if	!APL
 
 static int
@@ -259,10 +963,12 @@ capture_cb(XPLMDrawingPhase phase, int before, void *refcon)
 	UNUSED(before);
 	ASSERT(refcon != NULL);
 	hud = refcon;
+	ZONE_BEGIN(capture);
 	/*
 	 * No GL calls take place here, so no need for GLUTILS_RESET_ERRORS()
 	 */
 	dct = dr_geti(&hud->drs.draw_call_type);
+	STAT_INC(hud, dr_reads);
 	switch (dct) {
 	case DRAW_CALL_RIGHT_EYE:
 		idx = 1;
@@ -279,6 +985,7 @@ capture_cb(XPLMDrawingPhase phase, int before, void *refcon)
 	}
 
 	capture_mtx_common(hud, idx, dct);
+	ZONE_END(hud, capture);
 
 	return (1);
 }
@@ -289,8 +996,10 @@ static void
 capture_mtx_apple(hud_t *hud)
 {
 	ASSERT(hud != NULL);
+	ZONE_BEGIN(capture);
 	hud->num_eyes = 1;
 	capture_mtx_common(hud, 0, DRAW_CALL_MONO);
+	ZONE_END(hud, capture);
 }
 
 #endif	/* APL */
@@ -310,6 +1019,11 @@ draw_cb(XPLMDrawingPhase phase, int before, void *refcon)
 #if	APL
 	capture_mtx_apple(hud);
 #endif
+	/* Both eyes must render using the same parameter snapshot */
+	params_latch(hud);
+	frame_begin(hud);
+	if (hud->trace.fp != NULL)
+		trace_frame(hud);
 	/*
 	 * X-Plane tends to run in reverse-Y when drawing 3D. So in that
 	 * case, our projection is reversed. It's easiest to just swap
@@ -323,13 +1037,15 @@ draw_cb(XPLMDrawingPhase phase, int before, void *refcon)
 		glFrontFace(GL_CCW);
 	}
 	VERIFY3S(dr_getvi(&hud->drs.vp, old_vp, 0, 4), ==, 4);
+	STAT_INC(hud, dr_reads);
+	STAT_INC(hud, frames);
 	for (unsigned i = 0; i < hud->num_eyes; i++) {
 		mat4 pvm;
 
 		glm_mat4_mul(hud->proj_mtx[i], hud->acf_mtx[i], pvm);
 		glViewport(hud->vp[i][0], hud->vp[i][1],
 		    hud->vp[i][2], hud->vp[i][3]);
-		hud_render_eye(hud, pvm, hud->vp[i]);
+		render_eye(hud, pvm, hud->vp[i]);
 	}
 	/*
 	 * Restore original state
@@ -339,6 +1055,9 @@ draw_cb(XPLMDrawingPhase phase, int before, void *refcon)
 		glClipControl(saved_clip_origin, saved_depth_mode);
 		glFrontFace(saved_front_face);
 	}
+	/* Needs the normal clip origin, or the image ends up upside down */
+	if (hud->rb.enabled)
+		hud_readback_frame(hud);
 	GLUTILS_ASSERT_NO_ERROR();
 
 	return (1);
@@ -379,38 +1098,98 @@ reload_shaders(hud_t *hud)
 	hud->stencil_shader.pvm =
 	    glGetUniformLocation(hud->stencil_shader.prog, "pvm");
 
-	for (int i = 0; i < NUM_PROJ_SHADERS; i++) {
-		if (!hud_reload_shader(hud, &hud->proj_shader[i].prog,
-		    &proj_prog_info[i])) {
-			return (false);
-		}
-		hud->proj_shader[i].pvm = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "pvm");
-		hud->proj_shader[i].surf_tex = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "surf_tex");
-		hud->proj_shader[i].surf_sz = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "surf_sz");
-		hud->proj_shader[i].stencil_tex = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "stencil_tex");
-		hud->proj_shader[i].stencil_sz = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "stencil_sz");
-		hud->proj_shader[i].vp = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "vp");
-		hud->proj_shader[i].brt = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "brt");
-		hud->proj_shader[i].blur_radius = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "blur_radius");
-		hud->proj_shader[i].beam_color = glGetUniformLocation(
-		    hud->proj_shader[i].prog, "beam_color");
+	/* proj permutations are re-specialized lazily on their next use */
+	for (unsigned i = 0; i < NUM_PROJ_SHADERS; i++) {
+		if (hud->proj_shader[i].prog != 0)
+			glDeleteProgram(hud->proj_shader[i].prog);
+		hud->proj_shader[i].prog = 0;
+		hud->proj_shader[i].failed = false;
 	}
 
 	return (true);
 }
 
+/*
+ * Returns the proj shader permutation identified by `key' (a combination
+ * of the PROJ_* feature bits), specializing and linking it on first use.
+ * Returns NULL if the permutation failed to build.
+ */
+static const proj_shader_t *
+proj_shader_get(hud_t *hud, unsigned key)
+{
+	proj_shader_t *sh;
+	char progname[32];
+	const shader_spec_const_t spec_const[] = {
+	    {
+		.idx = PROJ_SPEC_GLOW,
+		.val = ((key & PROJ_GLOW) ? ((key & PROJ_GLOW_LQ) ? 2 : 1) : 0)
+	    },
+	    { .idx = PROJ_SPEC_MONOCHROME, .val = !!(key & PROJ_MONO) },
+	    {
+		.idx = PROJ_SPEC_PREMULTIPLIED,
+		.val = !!(key & PROJ_PREMUL)
+	    },
+	    { .idx = PROJ_SPEC_MIPMAPPED, .val = !!(key & PROJ_MIPS) },
+	    { .idx = PROJ_SPEC_REPROJECT, .val = !!(key & PROJ_REPROJ) },
+	    { .is_last = true }
+	};
+	const shader_info_t frag_info = {
+	    .filename = "proj.frag.spv",
+	    .spec_const = spec_const
+	};
+	const shader_prog_info_t prog_info = {
+	    .progname = progname,
+	    .vert = &generic_vert_info,
+	    .frag = &frag_info
+	};
+
+	ASSERT(hud != NULL);
+	ASSERT3U(key, <, NUM_PROJ_SHADERS);
+
+	sh = &hud->proj_shader[key];
+	if (sh->prog != 0)
+		return (sh);
+	/* Don't retry a broken shader on every frame */
+	if (sh->failed)
+		return (NULL);
+
+	snprintf(progname, sizeof (progname), "libhud_proj_%x", key);
+	if (!hud_reload_shader(hud, &sh->prog, &prog_info)) {
+		sh->failed = true;
+		return (NULL);
+	}
+	sh->pvm = glGetUniformLocation(sh->prog, "pvm");
+	sh->surf_tex = glGetUniformLocation(sh->prog, "surf_tex");
+	sh->surf_sz = glGetUniformLocation(sh->prog, "surf_sz");
+	sh->stencil_tex = glGetUniformLocation(sh->prog, "stencil_tex");
+	sh->stencil_sz = glGetUniformLocation(sh->prog, "stencil_sz");
+	sh->vp = glGetUniformLocation(sh->prog, "vp");
+	sh->brt = glGetUniformLocation(sh->prog, "brt");
+	sh->blur_radius = glGetUniformLocation(sh->prog, "blur_radius");
+	sh->beam_color = glGetUniformLocation(sh->prog, "beam_color");
+	sh->uv_xform = glGetUniformLocation(sh->prog, "uv_xform");
+
+	return (sh);
+}
+
 /**
  * Constructs and initializes a new HUD instance. The HUD is initially
  * set to disabled.
  *
+ * The following functions may be called from any thread:
+ *
+ * - the rendering parameter setters: hud_set_brightness,
+ *   hud_set_glow, hud_set_glass_opacity, hud_set_depth_test,
+ *   hud_set_premultiplied, hud_set_surface_mips, hud_set_mtcr,
+ *   hud_set_stencil_scale, hud_set_gpu_budget and
+ *   hud_set_memory_budget. The render thread picks up a consistent
+ *   snapshot of all of them once per frame, without ever blocking on
+ *   the setters.
+ * - hud_params_pending.
+ * - hud_surface_submit and hud_conformal_submit.
+ *
+ * All other functions must be called from the sim's main thread.
+ *
  * @param shader_dir A path to the directory containing the compiled
  *	libhud shaders in SPIR-V and GLSL format.
  * @param mtcr The mt_cairo_render_t instance that should be used as
@@ -445,13 +1224,25 @@ hud_new(const char *shader_dir, mt_cairo_render_t *mtcr, double glass_opacity,
 	ASSERT(proj != NULL);
 
 	hud->shader_dir = safe_strdup(shader_dir);
-	hud->mtcr = mtcr;
-	hud->brt = 1;
 
-	if (!reload_shaders(hud))
+	mutex_init(&hud->params.lock);
+	surf_init(&hud->surf);
+	surf_init(&hud->conf.surf);
+	hud->params.cur.mtcr = mtcr;
+	hud->params.cur.brt = 1;
+	hud->params.cur.glass_opacity = glass_opacity;
+	hud->params.cur.stencil_scale = 1;
+	for (int i = 0; i < 3; i++)
+		hud->params.buf[i] = hud->params.cur;
+	hud->params.front = 0;
+	hud->fsaa_ratio = VECT2(1, 1);
+	atomic_init(&hud->params.mid, 1);
+	hud->params.back = 2;
+	hud->snap = &hud->params.buf[0];
+
+	if (!reload_shaders(hud) || !proj_shaders_prepare(hud))
 		goto errout;
 
-	hud->glass_opacity = glass_opacity;
 	hud->glass = glass;
 	if (glass_group_id != NULL)
 		hud->glass_group = safe_strdup(glass_group_id);
@@ -473,6 +1264,9 @@ hud_new(const char *shader_dir, mt_cairo_render_t *mtcr, double glass_opacity,
 	fdr_find(&hud->drs.acf_mtx, "sim/graphics/view/acf_matrix");
 	fdr_find(&hud->drs.vp, "sim/graphics/view/viewport");
 	fdr_find(&hud->drs.rev_y, "sim/graphics/view/is_reverse_y");
+	fdr_find(&hud->drs.theta, "sim/flightmodel/position/theta");
+	fdr_find(&hud->drs.phi, "sim/flightmodel/position/phi");
+	fdr_find(&hud->drs.psi, "sim/flightmodel/position/psi");
 	fdr_find(&hud->drs.rev_float_z,
 	    "sim/graphics/view/is_reverse_float_z");
 	hud->drs.aa_ratio_avail = (dr_find(&hud->drs.fsaa_ratio_x,
@@ -498,23 +1292,50 @@ hud_destroy(hud_t *hud)
 		glDeleteProgram(hud->stencil_shader.prog);
 	if (hud->glass_shader.prog != 0)
 		glDeleteProgram(hud->glass_shader.prog);
-	for (int i = 0; i < NUM_PROJ_SHADERS; i++) {
+	for (unsigned i = 0; i < NUM_PROJ_SHADERS; i++) {
 		if (hud->proj_shader[i].prog != 0)
 			glDeleteProgram(hud->proj_shader[i].prog);
 	}
 	if (hud->stencil_fbo != 0)
 		glDeleteFramebuffers(1, &hud->stencil_fbo);
-	if (hud->stencil_depth_rbo != 0)
-		glDeleteRenderbuffers(1, &hud->stencil_depth_rbo);
 	if (hud->stencil_tex != 0) {
 		glDeleteTextures(1, &hud->stencil_tex);
 		IF_TEXSZ(TEXSZ_FREE(hud_glass_tex, GL_RED, GL_UNSIGNED_BYTE,
 		    hud->stencil_w, hud->stencil_h));
 	}
+	for (int i = 0; i < GOV_QUERY_RING; i++) {
+		if (hud->gov.queries[i].q[0] != 0)
+			glDeleteQueries(2, hud->gov.queries[i].q);
+	}
+	mip_free(hud);
+	if (hud->surf.enabled)
+		hud_surface_disable(hud);
+	if (hud->conf.surf.enabled)
+		hud_conformal_disable(hud);
 
+	if (hud->trace.fp != NULL)
+		hud_trace_stop(hud);
+	if (hud->rb.enabled)
+		hud_readback_disable(hud);
+	if (hud->flat.inited) {
+		glDeleteTextures(1, &hud->flat.white_tex);
+		IF_TEXSZ(TEXSZ_FREE(hud_flat_tex, GL_RED, GL_UNSIGNED_BYTE,
+		    1, 1));
+		glutils_destroy_quads(&hud->flat.quad);
+	}
+	if (hud->flat.cache_fbo != 0)
+		glDeleteFramebuffers(1, &hud->flat.cache_fbo);
+	if (hud->flat.cache_tex != 0) {
+		glDeleteTextures(1, &hud->flat.cache_tex);
+		IF_TEXSZ(TEXSZ_FREE(hud_flat_tex, GL_RGBA, GL_UNSIGNED_BYTE,
+		    hud->flat.cache_tex_w, hud->flat.cache_tex_h));
+	}
 	free(hud->shader_dir);
 	free(hud->glass_group);
 	free(hud->proj_group);
+	mutex_destroy(&hud->params.lock);
+	surf_fini(&hud->surf);
+	surf_fini(&hud->conf.surf);
 
 	if (hud->enabled) {
 #if	!APL
@@ -584,7 +1405,8 @@ void
 hud_set_brightness(hud_t *hud, float brt)
 {
 	ASSERT(hud != NULL);
-	hud->brt = brt;
+	params_enter(hud)->brt = brt;
+	params_exit(hud);
 }
 
 /**
@@ -595,19 +1417,27 @@ float
 hud_get_brightness(const hud_t *hud)
 {
 	ASSERT(hud != NULL);
-	return (hud->brt);
+	return (params_get(hud).brt);
 }
 
 /**
  * Changes the mt_cairo_render instance used by the HUD object.
  * DO NOT pass NULL here, or you will see sparks flying!
+ *
+ * The change only takes effect when the render thread starts its next
+ * frame, until then it keeps drawing from the previous instance. So
+ * before destroying the previous instance, wait for hud_params_pending
+ * to return false (or make sure the HUD isn't being rendered). When
+ * called from the render thread between frames, the previous instance
+ * may be destroyed right away.
  */
 void
 hud_set_mtcr(hud_t *hud, mt_cairo_render_t *mtcr)
 {
 	ASSERT(hud != NULL);
 	ASSERT(mtcr != NULL);
-	hud->mtcr = mtcr;
+	params_enter(hud)->mtcr = mtcr;
+	params_exit(hud);
 }
 
 /**
@@ -617,7 +1447,40 @@ mt_cairo_render_t *
 hud_get_mtcr(const hud_t *hud)
 {
 	ASSERT(hud != NULL);
-	return (hud->mtcr);
+	return (params_get(hud).mtcr);
+}
+
+/**
+ * Sets the resolution at which the combiner glass stencil mask is
+ * rendered, as a divisor of the viewport size. The mask is a hard-edged
+ * silhouette, so rendering it at a reduced resolution and re-sharpening
+ * the edge during projection saves fill rate and memory at little visual
+ * cost. This is especially beneficial in VR with high per-eye viewport
+ * resolutions.
+ *
+ * @param divisor Must be 1 (full resolution, the default), 2 (half
+ *	resolution, 1/4 of the pixels) or 4 (quarter resolution, 1/16
+ *	of the pixels). This is checked in release builds too, as the
+ *	divisor also sets the edge sharpening width in the projection
+ *	shader. Any other value is a fatal error.
+ */
+void
+hud_set_stencil_scale(hud_t *hud, unsigned divisor)
+{
+	ASSERT(hud != NULL);
+	VERIFY(divisor == 1 || divisor == 2 || divisor == 4);
+	params_enter(hud)->stencil_scale = divisor;
+	params_exit(hud);
+}
+
+/**
+ * Returns the stencil resolution divisor set using hud_set_stencil_scale.
+ */
+unsigned
+hud_get_stencil_scale(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (params_get(hud).stencil_scale);
 }
 
 /**
@@ -640,10 +1503,14 @@ hud_get_mtcr(const hud_t *hud)
 void
 hud_set_glow(hud_t *hud, bool flag, float blur_radius, vect3_t glow_color)
 {
+	hud_params_t *params;
+
 	ASSERT(hud != NULL);
-	hud->glow = flag;
-	hud->blur_radius = blur_radius;
-	hud->glow_color = glow_color;
+	params = params_enter(hud);
+	params->glow = flag;
+	params->blur_radius = blur_radius;
+	params->glow_color = glow_color;
+	params_exit(hud);
 }
 
 /**
@@ -659,12 +1526,15 @@ hud_set_glow(hud_t *hud, bool flag, float blur_radius, vect3_t glow_color)
 bool
 hud_get_glow(const hud_t *hud, float *blur_radius, vect3_t *glow_color)
 {
+	hud_params_t params;
+
 	ASSERT(hud != NULL);
+	params = params_get(hud);
 	if (blur_radius != NULL)
-		*blur_radius = hud->blur_radius;
+		*blur_radius = params.blur_radius;
 	if (glow_color != NULL)
-		*glow_color = hud->glow_color;
-	return (hud->glow);
+		*glow_color = params.glow_color;
+	return (params.glow);
 }
 
 /**
@@ -675,7 +1545,8 @@ void
 hud_set_glass_opacity(hud_t *hud, double glass_opacity)
 {
 	ASSERT(hud != NULL);
-	hud->glass_opacity = glass_opacity;
+	params_enter(hud)->glass_opacity = glass_opacity;
+	params_exit(hud);
 }
 
 /**
@@ -686,7 +1557,7 @@ double
 hud_get_glass_opacity(const hud_t *hud)
 {
 	ASSERT(hud != NULL);
-	return (hud->glass_opacity);
+	return (params_get(hud).glass_opacity);
 }
 
 /**
@@ -700,7 +1571,8 @@ void
 hud_set_depth_test(hud_t *hud, bool flag)
 {
 	ASSERT(hud != NULL);
-	hud->depth_test = flag;
+	params_enter(hud)->depth_test = flag;
+	params_exit(hud);
 }
 
 /*
@@ -710,19 +1582,457 @@ hud_set_depth_test(hud_t *hud, bool flag)
 bool
 hud_get_depth_test(const hud_t *hud)
 {
-	return (hud->depth_test);
+	ASSERT(hud != NULL);
+	return (params_get(hud).depth_test);
 }
 
-static void
-update_fbo(hud_t *hud, const vec4 vp)
+/**
+ * Configures whether the projection is rendered with premultiplied
+ * alpha. Cairo surfaces are premultiplied already, so in this mode the
+ * surface is used as-is: brightness and the glass stencil scale all four
+ * channels and the result is blended using GL_ONE, GL_ONE_MINUS_SRC_ALPHA.
+ * This saves a divide per fragment and avoids dark fringes around
+ * antialiased edges, which the default straight alpha mode produces when
+ * un-premultiplying the surface. The default is straight alpha.
+ */
+void
+hud_set_premultiplied(hud_t *hud, bool flag)
 {
-	int vp_w, vp_h;
-
 	ASSERT(hud != NULL);
-	ASSERT(vp != NULL);
+	params_enter(hud)->premul = flag;
+	params_exit(hud);
+}
 
-	vp_w = vp[2];
-	vp_h = vp[3];
+/**
+ * Returns true if premultiplied alpha rendering is enabled.
+ * See hud_set_premultiplied.
+ */
+bool
+hud_get_premultiplied(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (params_get(hud).premul);
+}
+
+/**
+ * Configures whether libhud samples the surface through a mip chain.
+ * When the projection covers far fewer pixels than the surface has,
+ * sampling the full resolution surface thrashes the texture cache and
+ * aliases. With this enabled, libhud keeps a mipmapped copy of the
+ * surface, regenerated only when mt_cairo_render has produced a new
+ * frame. The projection then gets trilinear filtering following its
+ * screen footprint and the glow taps read from a coarser level. This
+ * costs a copy of the surface (plus 1/3 for the mip levels) in GPU
+ * memory, which counts towards the memory budget. If the copy doesn't
+ * fit in the budget, the surface is sampled directly. The default is
+ * disabled.
+ */
+void
+hud_set_surface_mips(hud_t *hud, bool flag)
+{
+	ASSERT(hud != NULL);
+	params_enter(hud)->surface_mips = flag;
+	params_exit(hud);
+}
+
+/**
+ * Returns true if surface mipmapping is enabled.
+ * See hud_set_surface_mips.
+ */
+bool
+hud_get_surface_mips(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (params_get(hud).surface_mips);
+}
+
+/*
+ * Computes the GPU memory used by the HUD's textures & buffers. This
+ * doesn't include shader programs, as querying those requires a GL call.
+ */
+static void
+mem_usage_compute(const hud_t *hud, hud_mem_usage_t *usage)
+{
+	ASSERT(hud != NULL);
+	ASSERT(usage != NULL);
+
+	memset(usage, 0, sizeof (*usage));
+	usage->stencil = (size_t)hud->stencil_w * hud->stencil_h;
+	if (hud->flat.inited)
+		usage->flat = 1;
+	usage->flat += (size_t)hud->flat.cache_tex_w *
+	    hud->flat.cache_tex_h * 4;
+	usage->mips = hud->mip.bytes;
+	/* The surface textures & equally sized upload PBOs */
+	if (hud->surf.enabled) {
+		usage->surface = (size_t)hud->surf.w * hud->surf.h *
+		    hud->surf.bpp * 2;
+	}
+	if (hud->conf.surf.enabled) {
+		usage->surface += (size_t)hud->conf.surf.w *
+		    hud->conf.surf.h * hud->conf.surf.bpp * 2;
+	}
+	if (hud->rb.enabled) {
+		usage->readback = (size_t)hud->rb.w * hud->rb.h * 4 *
+		    (1 + RB_NUM_PBOS);
+	}
+	usage->total = usage->stencil + usage->flat + usage->mips +
+	    usage->surface + usage->readback;
+}
+
+/*
+ * Returns how many bytes a resource of size `cur_sz' may grow to, given
+ * the memory budget and the usage of all other resources. Returns
+ * SIZE_MAX if no budget is set. The budget is read from the latest
+ * parameters rather than the frame snapshot, so a budget set just
+ * before enabling a surface or readback already applies to it.
+ */
+static size_t
+mem_avail(const hud_t *hud, size_t cur_sz)
+{
+	hud_mem_usage_t usage;
+	size_t budget, others;
+
+	ASSERT(hud != NULL);
+
+	budget = params_get(hud).mem_budget;
+	if (budget == 0)
+		return (SIZE_MAX);
+	mem_usage_compute(hud, &usage);
+	ASSERT3U(usage.total, >=, cur_sz);
+	others = usage.total - cur_sz;
+	if (others >= budget)
+		return (0);
+	return (budget - others);
+}
+
+static void
+mip_free(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+
+	if (hud->mip.fbo[0] != 0)
+		glDeleteFramebuffers(2, hud->mip.fbo);
+	if (hud->mip.tex != 0) {
+		glDeleteTextures(1, &hud->mip.tex);
+		IF_TEXSZ(TEXSZ_FREE_BYTES(hud_mip_tex, hud->mip.bytes));
+	}
+	memset(&hud->mip, 0, sizeof (hud->mip));
+}
+
+static bool
+mip_alloc(hud_t *hud, unsigned w, unsigned h, bool mono)
+{
+	unsigned levels = 1;
+	size_t bytes = 0;
+
+	ASSERT(hud != NULL);
+	ASSERT(hud->mip.tex == 0);
+
+	for (unsigned lw = w, lh = h;; lw = MAX(lw / 2, 1),
+	    lh = MAX(lh / 2, 1), levels++) {
+		bytes += (size_t)lw * lh * (mono ? 1 : 4);
+		if (lw == 1 && lh == 1)
+			break;
+	}
+	if (bytes > mem_avail(hud, 0))
+		return (false);
+
+	glGenTextures(1, &hud->mip.tex);
+	XPLMBindTexture2d(hud->mip.tex, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+	    GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	IF_TEXSZ(TEXSZ_ALLOC_BYTES(hud_mip_tex, bytes));
+	/* glGenerateMipmap allocates the remaining levels */
+	glTexImage2D(GL_TEXTURE_2D, 0, mono ? GL_R8 : GL_RGBA8, w, h, 0,
+	    mono ? GL_RED : GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	XPLMBindTexture2d(0, 0);
+
+	glGenFramebuffers(2, hud->mip.fbo);
+	hud->mip.w = w;
+	hud->mip.h = h;
+	hud->mip.mono = mono;
+	hud->mip.bytes = bytes;
+
+	return (true);
+}
+
+/*
+ * Returns the position & size of surface tile `tile' in pixels.
+ */
+static void
+surf_tile_rect(const surf_t *surf, unsigned tile, unsigned *x, unsigned *y,
+    unsigned *w, unsigned *h)
+{
+	ASSERT(surf != NULL);
+	ASSERT3U(tile, <, surf->tiles_x * surf->tiles_y);
+
+	*x = (tile % surf->tiles_x) * SURF_TILE;
+	*y = (tile / surf->tiles_x) * SURF_TILE;
+	*w = MIN(surf->w - *x, SURF_TILE);
+	*h = MIN(surf->h - *y, SURF_TILE);
+}
+
+/*
+ * Uploads all surface tiles which have been marked dirty since the last
+ * upload. Under the lock, we only pin the front buffer and take the list
+ * of dirty tiles. The tiles are then packed from the pinned buffer into
+ * a streaming PBO with the lock released, so a submitter can publish
+ * meanwhile (see surf_publish). The PBO is orphaned on every upload so
+ * we never wait for the previous transfer to finish, and the tiles are
+ * transferred into the texture with one glTexSubImage2D each. Returns
+ * true if anything was uploaded.
+ */
+static bool
+surf_upload(hud_t *hud, surf_t *surf)
+{
+	size_t sz, off = 0;
+	unsigned n = 0;
+	const uint8_t *src;
+	uint8_t *buf;
+	vect3_t att;
+	GLint old_align;
+
+	ASSERT(hud != NULL);
+	ASSERT(surf != NULL);
+	ASSERT(surf->enabled);
+
+	mutex_enter(&surf->lock);
+	if (surf->num_dirty == 0) {
+		/* The texture is up to date with `front' */
+		surf->tex_att = surf->att;
+		mutex_exit(&surf->lock);
+		return (false);
+	}
+	ASSERT3U(surf->pinned, ==, SURF_NUM_BUFS);
+	surf->pinned = surf->front;
+	src = surf->buf[surf->front];
+	att = surf->att;
+	for (unsigned i = 0; i < surf->tiles_x * surf->tiles_y; i++) {
+		if (surf->dirty[i]) {
+			surf->upload[n++] = i;
+			surf->dirty[i] = false;
+		}
+	}
+	ASSERT3U(n, ==, surf->num_dirty);
+	surf->num_dirty = 0;
+	mutex_exit(&surf->lock);
+
+	glutils_debug_push(0, "hud_surface_upload");
+	sz = (size_t)surf->w * surf->h * surf->bpp;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, surf->pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, sz, NULL, GL_STREAM_DRAW);
+	buf = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, sz,
+	    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (buf == NULL) {
+		/* Mark the tiles dirty again, we'll retry on the next frame */
+		mutex_enter(&surf->lock);
+		for (unsigned i = 0; i < n; i++) {
+			if (!surf->dirty[surf->upload[i]]) {
+				surf->dirty[surf->upload[i]] = true;
+				surf->num_dirty++;
+			}
+		}
+		surf->pinned = SURF_NUM_BUFS;
+		mutex_exit(&surf->lock);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glutils_debug_pop();
+		return (false);
+	}
+	for (unsigned i = 0; i < n; i++) {
+		unsigned x, y, w, h;
+
+		surf_tile_rect(surf, surf->upload[i], &x, &y, &w, &h);
+		for (unsigned row = 0; row < h; row++) {
+			memcpy(&buf[off + row * w * surf->bpp],
+			    &src[((size_t)(y + row) * surf->w + x) *
+			    surf->bpp], w * surf->bpp);
+		}
+		off += w * h * surf->bpp;
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	mutex_enter(&surf->lock);
+	surf->pinned = SURF_NUM_BUFS;
+	mutex_exit(&surf->lock);
+	surf->tex_att = att;
+
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &old_align);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	XPLMBindTexture2d(surf->tex, 0);
+	off = 0;
+	for (unsigned i = 0; i < n; i++) {
+		unsigned x, y, w, h;
+
+		surf_tile_rect(surf, surf->upload[i], &x, &y, &w, &h);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h,
+		    surf->bpp == 1 ? GL_RED : GL_BGRA, GL_UNSIGNED_BYTE,
+		    (void *)off);
+		off += w * h * surf->bpp;
+	}
+	XPLMBindTexture2d(0, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, old_align);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	surf->gen++;
+	STAT_ADD(hud, surf_tiles, n);
+	STAT_ADD(hud, surf_upload_bytes, off);
+
+	glutils_debug_pop();
+
+	return (true);
+}
+
+/*
+ * Main surface accessors. These return the libhud-owned surface when
+ * it is enabled, otherwise the mtcr. Pending changes to the libhud-owned
+ * surface are uploaded by src_update, once per frame.
+ */
+static GLuint
+surf_tex_raw(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	if (hud->surf.enabled)
+		return (hud->surf.tex);
+	return (mt_cairo_render_get_tex(hud->snap->mtcr));
+}
+
+static vect2_t
+surf_size(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	if (hud->surf.enabled)
+		return (VECT2(hud->surf.w, hud->surf.h));
+	return (VECT2(mt_cairo_render_get_width(hud->snap->mtcr),
+	    mt_cairo_render_get_height(hud->snap->mtcr)));
+}
+
+static vect3_t
+surf_monochrome(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	if (hud->surf.enabled)
+		return (hud->surf.monochrome);
+	return (mt_cairo_render_get_monochrome(hud->snap->mtcr));
+}
+
+/*
+ * Uploads any pending changes to the libhud-owned surface and checks
+ * whether the surface has changed since the previous frame, i.e. mtcr
+ * has swapped in a new texture (uploaded a new frame), a different mtcr
+ * has been set, or the libhud-owned surface has been updated, and if
+ * so, bumps the source generation. Called once per frame by
+ * frame_begin.
+ */
+static void
+src_update(hud_t *hud)
+{
+	GLuint tex;
+
+	ASSERT(hud != NULL);
+
+	if (hud->surf.enabled)
+		(void) surf_upload(hud, &hud->surf);
+	tex = surf_tex_raw(hud);
+	if (tex != hud->src.tex || hud->snap->mtcr != hud->src.mtcr ||
+	    hud->surf.gen != hud->src.surf_gen) {
+		hud->src.tex = tex;
+		hud->src.mtcr = hud->snap->mtcr;
+		hud->src.surf_gen = hud->surf.gen;
+		hud->src.gen++;
+	}
+}
+
+/*
+ * Returns the texture to sample the surface from. With surface mips
+ * enabled, this is the mipmapped copy of the surface texture, which we
+ * refresh whenever the source generation changes (see src_update), and
+ * `mipmapped' is set to true. Otherwise (or if the copy doesn't fit in
+ * the memory budget), returns the surface texture itself.
+ */
+static GLuint
+surface_tex_get(hud_t *hud, bool *mipmapped)
+{
+	GLuint src_tex;
+	unsigned w, h;
+	bool mono;
+	GLint old_read_fbo, old_draw_fbo;
+
+	ASSERT(hud != NULL);
+	ASSERT(mipmapped != NULL);
+
+	*mipmapped = false;
+	src_tex = surf_tex_raw(hud);
+	if (!hud->snap->surface_mips) {
+		if (hud->mip.tex != 0)
+			mip_free(hud);
+		return (src_tex);
+	}
+	if (src_tex == 0)
+		return (0);
+	if (hud->mip.tex != 0 && hud->mip.src_gen == hud->src.gen) {
+		*mipmapped = true;
+		return (hud->mip.tex);
+	}
+	w = surf_size(hud).x;
+	h = surf_size(hud).y;
+	mono = !IS_NULL_VECT(surf_monochrome(hud));
+	if (hud->mip.w != w || hud->mip.h != h || hud->mip.mono != mono) {
+		mip_free(hud);
+		if (!mip_alloc(hud, w, h, mono))
+			return (src_tex);
+	}
+	glutils_debug_push(0, "hud_surface_mips");
+
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &old_read_fbo);
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &old_draw_fbo);
+	glBindFramebufferEXT(GL_READ_FRAMEBUFFER, hud->mip.fbo[0]);
+	glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	    GL_TEXTURE_2D, src_tex, 0);
+	glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, hud->mip.fbo[1]);
+	glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	    GL_TEXTURE_2D, hud->mip.tex, 0);
+	glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT,
+	    GL_NEAREST);
+	glBindFramebufferEXT(GL_READ_FRAMEBUFFER, old_read_fbo);
+	glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, old_draw_fbo);
+
+	XPLMBindTexture2d(hud->mip.tex, 0);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	XPLMBindTexture2d(0, 0);
+	hud->mip.src_gen = hud->src.gen;
+
+	glutils_debug_pop();
+	*mipmapped = true;
+
+	return (hud->mip.tex);
+}
+
+static void
+update_fbo(hud_t *hud, const vec4 vp)
+{
+	int vp_w, vp_h;
+	unsigned scale;
+	size_t avail;
+
+	ASSERT(hud != NULL);
+	ASSERT(vp != NULL);
+
+	scale = hud->snap->stencil_scale;
+	if (hud->gov.level >= HUD_QUALITY_STENCIL_HALF)
+		scale = MIN(scale * 2, MAX_STENCIL_SCALE);
+	/*
+	 * If we're over the memory budget, rather than growing, drop to
+	 * a lower resolution stencil.
+	 */
+	avail = mem_avail(hud, (size_t)hud->stencil_w * hud->stencil_h);
+	while (scale < MAX_STENCIL_SCALE &&
+	    (size_t)(vp[2] / scale) * (size_t)(vp[3] / scale) > avail)
+		scale *= 2;
+	vp_w = MAX(vp[2] / scale, 1);
+	vp_h = MAX(vp[3] / scale, 1);
 
 	if (hud->stencil_w == vp_w && hud->stencil_h == vp_h) {
 		ASSERT(hud->stencil_fbo != 0);
@@ -730,8 +2040,6 @@ update_fbo(hud_t *hud, const vec4 vp)
 	}
 	if (hud->stencil_fbo != 0)
 		glDeleteFramebuffers(1, &hud->stencil_fbo);
-	if (hud->stencil_depth_rbo != 0)
-		glDeleteRenderbuffers(1, &hud->stencil_depth_rbo);
 	if (hud->stencil_tex != 0) {
 		IF_TEXSZ(TEXSZ_FREE(hud_glass_tex, GL_RED, GL_UNSIGNED_BYTE,
 		    hud->stencil_w, hud->stencil_h));
@@ -740,6 +2048,7 @@ update_fbo(hud_t *hud, const vec4 vp)
 
 	hud->stencil_w = vp_w;
 	hud->stencil_h = vp_h;
+	STAT_INC(hud, fbo_rebuilds);
 
 	glGenTextures(1, &hud->stencil_tex);
 	XPLMBindTexture2d(hud->stencil_tex, 0);
@@ -752,24 +2061,21 @@ update_fbo(hud_t *hud, const vec4 vp)
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, hud->stencil_w, hud->stencil_h,
 	    0, GL_RED, GL_UNSIGNED_BYTE, NULL);
 
-	glGenRenderbuffers(1, &hud->stencil_depth_rbo);
-	glBindRenderbuffer(GL_RENDERBUFFER, hud->stencil_depth_rbo);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16,
-	    hud->stencil_w, hud->stencil_h);
-	glBindRenderbuffer(GL_RENDERBUFFER, 0);
-
+	/*
+	 * No depth attachment is needed: the stencil shader writes the
+	 * same constant value for every fragment of the glass, so the
+	 * order in which overlapping fragments land doesn't matter.
+	 */
 	glGenFramebuffers(1, &hud->stencil_fbo);
 	glBindFramebufferEXT(GL_FRAMEBUFFER, hud->stencil_fbo);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
 	    GL_TEXTURE_2D, hud->stencil_tex, 0);
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-	    GL_RENDERBUFFER, hud->stencil_depth_rbo);
 	VERIFY3U(glCheckFramebufferStatus(GL_FRAMEBUFFER), ==,
 	    GL_FRAMEBUFFER_COMPLETE);
 }
 
 static void
-render_stencil(const hud_t *hud, const mat4 pvm, const vec4 vp)
+render_stencil(hud_t *hud, const mat4 pvm, const vec4 vp)
 {
 	GLint old_fbo;
 
@@ -778,154 +2084,2025 @@ render_stencil(const hud_t *hud, const mat4 pvm, const vec4 vp)
 	ASSERT(vp != NULL);
 
 	glutils_debug_push(0, "hud_render_stencil");
+	ZONE_BEGIN(stencil);
 
 	old_fbo = dr_geti(&hud->drs.old_fbo);
+	STAT_INC(hud, dr_reads);
 
 	glBindFramebufferEXT(GL_FRAMEBUFFER, hud->stencil_fbo);
 	glViewport(0, 0, hud->stencil_w, hud->stencil_h);
 	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glClear(GL_COLOR_BUFFER_BIT);
 
 	glUseProgram(hud->stencil_shader.prog);
 	glUniformMatrix4fv(hud->stencil_shader.pvm, 1, GL_FALSE,
 	    (GLfloat *)pvm);
 	obj8_draw_group(hud->glass, hud->glass_group,
 	    hud->stencil_shader.prog, pvm);
+	STAT_INC(hud, prog_binds);
+	STAT_INC(hud, uniform_uploads);
+	STAT_INC(hud, draw_calls);
 
 	glBindFramebufferEXT(GL_FRAMEBUFFER, old_fbo);
 	glViewport(vp[0], vp[1], vp[2], vp[3]);
 
+	ZONE_END(hud, stencil);
 	glutils_debug_pop();
 }
 
 static void
-render_glass(const hud_t *hud, const mat4 pvm)
+render_glass(hud_t *hud, const mat4 pvm)
 {
 	ASSERT(hud != NULL);
 	ASSERT(pvm != NULL);
 
-	if (hud->glass_opacity == 0)
+	if (hud->snap->glass_opacity == 0)
 		return;
 
 	glutils_debug_push(0, "hud_render_glass");
+	ZONE_BEGIN(glass);
 
 	glUseProgram(hud->glass_shader.prog);
 	glUniformMatrix4fv(hud->glass_shader.pvm, 1, GL_FALSE, (GLfloat *)pvm);
-	glUniform1f(hud->glass_shader.opacity, hud->glass_opacity);
+	glUniform1f(hud->glass_shader.opacity, hud->snap->glass_opacity);
 	obj8_draw_group(hud->glass, hud->glass_group,
 	    hud->glass_shader.prog, pvm);
+	STAT_INC(hud, prog_binds);
+	STAT_ADD(hud, uniform_uploads, 2);
+	STAT_INC(hud, draw_calls);
 
+	ZONE_END(hud, glass);
 	glutils_debug_pop();
 }
 
+/*
+ * Draws surface texture `tex' using the proj shader permutation `key'.
+ * When `flat' is true, the surface is drawn into a 2D rect (as set up by
+ * `pvm') instead of onto the projection object and the glass stencil is
+ * ignored.
+ */
 static void
-render_projection(const hud_t *hud, const mat4 pvm, const vec4 vp,
-    unsigned prog, bool is_glow)
+draw_projection(hud_t *hud, const mat4 pvm, const vec4 vp, unsigned key,
+    GLuint tex, vect2_t surf_sz, float brt, vect3_t beam_color, bool flat)
 {
-	vect3_t beam_color;
-	GLuint tex;
+	const proj_shader_t *sh;
+	GLboolean saved_depth;
 
 	ASSERT(hud != NULL);
 	ASSERT(pvm != NULL);
 	ASSERT(vp != NULL);
-	ASSERT3U(prog, <, ARRAY_NUM_ELEM(hud->proj_shader));
+	ASSERT(tex != 0);
 
-	tex = mt_cairo_render_get_tex(hud->mtcr);
-	if (tex == 0)
+	sh = proj_shader_get(hud, key);
+	if (sh == NULL)
 		return;
-	if (is_glow)
-		beam_color = hud->glow_color;
-	else
-		beam_color = mt_cairo_render_get_monochrome(hud->mtcr);
 
 	glutils_debug_push(0, "hud_render_projection");
+	ZONE_BEGIN(proj);
 
-	if (!hud->depth_test)
+	saved_depth = glIsEnabled(GL_DEPTH_TEST);
+	if (flat || !hud->snap->depth_test)
 		glDisable(GL_DEPTH_TEST);
-	glUseProgram(hud->proj_shader[prog].prog);
+	glUseProgram(sh->prog);
 
-	glUniformMatrix4fv(hud->proj_shader[prog].pvm,
-	    1, GL_FALSE, (GLfloat *)pvm);
+	glUniformMatrix4fv(sh->pvm, 1, GL_FALSE, (GLfloat *)pvm);
 
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, tex);
-	glUniform1i(hud->proj_shader[prog].surf_tex, 0);
-	glUniform2f(hud->proj_shader[prog].surf_sz,
-	    mt_cairo_render_get_width(hud->mtcr),
-	    mt_cairo_render_get_height(hud->mtcr));
+	glUniform1i(sh->surf_tex, 0);
+	glUniform2f(sh->surf_sz, surf_sz.x, surf_sz.y);
 
 	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, hud->stencil_tex);
-	glUniform1i(hud->proj_shader[prog].stencil_tex, 1);
-
-	glUniform2f(hud->proj_shader[prog].stencil_sz,
-	    hud->stencil_w, hud->stencil_h);
+	if (flat) {
+		glBindTexture(GL_TEXTURE_2D, hud->flat.white_tex);
+		glUniform2f(sh->stencil_sz, 1, 1);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, hud->stencil_tex);
+		glUniform2f(sh->stencil_sz, hud->stencil_w, hud->stencil_h);
+	}
+	glUniform1i(sh->stencil_tex, 1);
 
-	glUniform4f(hud->proj_shader[prog].vp, vp[0], vp[1], vp[2], vp[3]);
-	glUniform1f(hud->proj_shader[prog].brt, hud->brt);
+	glUniform4f(sh->vp, vp[0], vp[1], vp[2], vp[3]);
+	glUniform1f(sh->brt, brt);
 
-	glUniform1f(hud->proj_shader[prog].blur_radius, hud->blur_radius);
-	glUniform1f(hud->proj_shader[prog].brt, hud->brt);
+	glUniform1f(sh->blur_radius, hud->snap->blur_radius);
+	STAT_ADD(hud, uniform_uploads, 8);
 	if (!IS_NULL_VECT(beam_color)) {
-		glUniform3f(hud->proj_shader[prog].beam_color,
+		glUniform3f(sh->beam_color,
 		    beam_color.x, beam_color.y, beam_color.z);
+		STAT_INC(hud, uniform_uploads);
 	}
-	obj8_draw_group(hud->proj, hud->proj_group,
-	    hud->proj_shader[prog].prog, pvm);
+	if (key & PROJ_REPROJ) {
+		glUniformMatrix3fv(sh->uv_xform, 1, GL_FALSE,
+		    (GLfloat *)hud->conf.uv_xform);
+		STAT_INC(hud, uniform_uploads);
+	}
+	if (flat)
+		glutils_draw_quads(&hud->flat.quad, sh->prog);
+	else
+		obj8_draw_group(hud->proj, hud->proj_group, sh->prog, pvm);
+	STAT_INC(hud, prog_binds);
+	STAT_INC(hud, draw_calls);
 
 	glUseProgram(0);
 	XPLMBindTexture2d(0, 1);
 	XPLMBindTexture2d(0, 0);
 	glActiveTexture(GL_TEXTURE0);
-	if (!hud->depth_test)
+	if (saved_depth)
 		glEnable(GL_DEPTH_TEST);
 
+	ZONE_END(hud, proj);
 	glutils_debug_pop();
 }
 
-/**
- * Allows invoking the HUD renderer with a custom projection-modelview
- * matrix and viewport. If you are using `hud_set_enabled', you don't
- * need to call this.
+/*
+ * Renders the HUD's surface using proj shader permutation `key', either
+ * as the glow or main pass. See draw_projection for `flat'.
  */
-void
-hud_render_eye(hud_t *hud, const mat4 pvm, const vec4 vp)
+static void
+render_projection(hud_t *hud, const mat4 pvm, const vec4 vp,
+    unsigned key, bool is_glow, bool flat)
 {
-	vect3_t monochrome;
+	vect3_t beam_color;
+	GLuint tex;
+	bool mipmapped;
 
 	ASSERT(hud != NULL);
-	ASSERT(pvm != NULL);
-	ASSERT(vp != NULL);
 
-	monochrome = mt_cairo_render_get_monochrome(hud->mtcr);
+	tex = surface_tex_get(hud, &mipmapped);
+	if (tex == 0)
+		return;
+	if (mipmapped)
+		key |= PROJ_MIPS;
+	if (is_glow)
+		beam_color = hud->snap->glow_color;
+	else
+		beam_color = surf_monochrome(hud);
+	draw_projection(hud, pvm, vp, key, tex, surf_size(hud),
+	    hud->snap->brt, beam_color, flat);
+}
 
-	glutils_debug_push(0, "hud_render");
+/*
+ * Uploads any pending changes to the conformal layer and prepares it for
+ * rendering this frame, setting conf.active if there is anything to
+ * render. Computes the UV transform, which reprojects the layer from the
+ * attitude it was rendered at to the current aircraft attitude. For a
+ * point p on the surface (in pixels, y pointing down), the rendered
+ * surface is sampled at:
+ *
+ *	p_src = c + R(d_roll)(p - c) + (d_hdg * k, -d_pitch * k)
+ *
+ * where c is the boresight, k is the pixels per degree and d_* are the
+ * attitude changes since the layer was rendered.
+ */
+static void
+conf_update(hud_t *hud)
+{
+	const surf_t *surf = &hud->conf.surf;
+	vect3_t att, d;
+	vect2_t sz, c;
+	double k, sin_r, cos_r;
+	mat3 *m;
 
-	glEnable(GL_BLEND);
+	ASSERT(hud != NULL);
 
-	update_fbo(hud, vp);
+	hud->conf.active = false;
+	if (!surf->enabled)
+		return;
+	(void) surf_upload(hud, &hud->conf.surf);
+	att = VECT3(dr_getf(&hud->drs.theta), dr_getf(&hud->drs.phi),
+	    dr_getf(&hud->drs.psi));
+	STAT_ADD(hud, dr_reads, 3);
+	/* tex_att always matches the uploaded contents of the texture */
+	d = vect3_sub(att, surf->tex_att);
+	/* Take the short way around the heading wrap */
+	d.z = fmod(d.z + 540, 360) - 180;
 
-	/* Draw the glass stencil layer */
-	render_stencil(hud, pvm, vp);
+	sz = VECT2(surf->w, surf->h);
+	c = hud->conf.center;
+	k = hud->conf.px_per_deg;
+	sin_r = sin(DEG2RAD(d.y));
+	cos_r = cos(DEG2RAD(d.y));
+	/*
+	 * The above in normalized UV coordinates, as a column-major
+	 * affine matrix: uv_src = S^-1 * (R * S * uv + c - R * c + o),
+	 * where S scales from UV to pixels and o is the pitch/hdg offset.
+	 */
+	m = &hud->conf.uv_xform;
+	(*m)[0][0] = cos_r;
+	(*m)[0][1] = sin_r * sz.x / sz.y;
+	(*m)[0][2] = 0;
+	(*m)[1][0] = -sin_r * sz.y / sz.x;
+	(*m)[1][1] = cos_r;
+	(*m)[1][2] = 0;
+	(*m)[2][0] = (c.x - (cos_r * c.x - sin_r * c.y) + d.z * k) / sz.x;
+	(*m)[2][1] = (c.y - (sin_r * c.x + cos_r * c.y) - d.x * k) / sz.y;
+	(*m)[2][2] = 1;
+	hud->conf.active = true;
+}
 
-	/* Draw the opaque glass layer */
-	glDepthMask(GL_FALSE);
-	render_glass(hud, pvm);
+/*
+ * Per-frame setup, done right after latching the parameters, so that
+ * all eyes & passes of a frame see the same surface contents and the
+ * same aircraft attitude.
+ */
+static void
+frame_begin(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	src_update(hud);
+	conf_update(hud);
+}
 
-	/* Draw the actual collimated projection */
-	if (hud->glow) {
-		if (IS_NULL_VECT(monochrome)) {
-			render_projection(hud, pvm, vp, PROJ_SHADER_GLOW, true);
-		} else {
-			render_projection(hud, pvm, vp, PROJ_SHADER_MONO_GLOW,
-			    true);
-		}
+/*
+ * Renders the conformal layer, reprojected using the transform computed
+ * by conf_update. `key' is adjusted for the layer's own surface type.
+ */
+static void
+render_conformal(hud_t *hud, const mat4 pvm, const vec4 vp,
+    unsigned key, bool is_glow, bool flat)
+{
+	const surf_t *surf = &hud->conf.surf;
+
+	ASSERT(hud != NULL);
+	ASSERT(hud->conf.active);
+
+	key &= ~(PROJ_MONO | PROJ_MIPS);
+	key |= PROJ_REPROJ | (IS_NULL_VECT(surf->monochrome) ? 0 : PROJ_MONO);
+	draw_projection(hud, pvm, vp, key, surf->tex,
+	    VECT2(surf->w, surf->h), hud->snap->brt,
+	    is_glow ? hud->snap->glow_color : surf->monochrome, flat);
+}
+
+/*
+ * Selects the proj shader permutations to use, taking into account the
+ * surface type and the governor's current quality level. Returns true
+ * if a glow pass should be rendered using `glow_key' (otherwise
+ * `glow_key' is left untouched).
+ */
+static bool
+proj_keys_select(const hud_t *hud, unsigned *glow_key, unsigned *main_key)
+{
+	bool mono, lq;
+
+	ASSERT(hud != NULL);
+	ASSERT(glow_key != NULL);
+	ASSERT(main_key != NULL);
+
+	mono = !IS_NULL_VECT(surf_monochrome(hud));
+	lq = (hud->gov.level >= HUD_QUALITY_GLOW_REDUCED);
+	*main_key = (mono ? PROJ_MONO : 0) |
+	    (hud->snap->premul ? PROJ_PREMUL : 0);
+	if (!hud->snap->glow || hud->gov.level >= HUD_QUALITY_GLOW_OFF)
+		return (false);
+	*glow_key = *main_key | PROJ_GLOW | (lq ? PROJ_GLOW_LQ : 0);
+	return (true);
+}
+
+/*
+ * Specializes all proj permutations which the governor can switch
+ * between under the current settings, so stepping the quality level
+ * never incurs a synchronous shader compile in the middle of a frame
+ * which is already over budget. Returns false if the main permutation
+ * failed to build.
+ */
+static bool
+proj_shaders_prepare(hud_t *hud)
+{
+	unsigned main_key, glow_key;
+
+	ASSERT(hud != NULL);
+
+	(void) proj_keys_select(hud, &glow_key, &main_key);
+	if (hud->mip.tex != 0)
+		main_key |= PROJ_MIPS;
+	if (hud->snap->glow) {
+		(void) proj_shader_get(hud, main_key | PROJ_GLOW);
+		(void) proj_shader_get(hud, main_key | PROJ_GLOW |
+		    PROJ_GLOW_LQ);
 	}
-	if (IS_NULL_VECT(monochrome))
-		render_projection(hud, pvm, vp, PROJ_SHADER_NOGLOW, false);
-	else
-		render_projection(hud, pvm, vp, PROJ_SHADER_MONO_NOGLOW, false);
-	glDepthMask(GL_TRUE);
+	return (proj_shader_get(hud, main_key) != NULL);
+}
 
-	glutils_debug_pop();
+static void
+flat_init(hud_t *hud)
+{
+	static const uint8_t white = 0xff;
+	/* Unit quad, with the top of the surface at the top of the rect */
+	const vect2_t p[4] = {
+	    VECT2(0, 0), VECT2(0, 1), VECT2(1, 1), VECT2(1, 0)
+	};
+	const vect2_t t[4] = {
+	    VECT2(0, 1), VECT2(0, 0), VECT2(1, 0), VECT2(1, 1)
+	};
+	GLint old_align;
+
+	ASSERT(hud != NULL);
+
+	if (hud->flat.inited)
+		return;
+
+	glGenTextures(1, &hud->flat.white_tex);
+	XPLMBindTexture2d(hud->flat.white_tex, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glGetIntegerv(GL_UNPACK_ALIGNMENT, &old_align);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	IF_TEXSZ(TEXSZ_ALLOC(hud_flat_tex, GL_RED, GL_UNSIGNED_BYTE, 1, 1));
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 1, 1, 0, GL_RED,
+	    GL_UNSIGNED_BYTE, &white);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, old_align);
+	XPLMBindTexture2d(0, 0);
+
+	glutils_init_2D_quads(&hud->flat.quad, p, t, 4);
+	hud->flat.inited = true;
+}
+
+/*
+ * Like VECT3_EQ, but also treats two null vectors as equal.
+ */
+static inline bool
+vect3_same(vect3_t a, vect3_t b)
+{
+	if (IS_NULL_VECT(a) || IS_NULL_VECT(b))
+		return (IS_NULL_VECT(a) && IS_NULL_VECT(b));
+	return (VECT3_EQ(a, b));
+}
+
+/*
+ * Makes sure the flat glow cache holds the glow & main passes composited
+ * for the current surface contents. The composite is stored in the same
+ * orientation as the surface and at full brightness, so it can be drawn
+ * in place of the surface using the RGBA no-glow shader.
+ */
+static void
+flat_cache_update(hud_t *hud, unsigned glow_key, unsigned main_key)
+{
+	GLuint src_tex;
+	unsigned w, h, tex_w, tex_h;
+	vect3_t monochrome;
+	GLint old_fbo, old_vp[4];
+	mat4 pvm;
+	vec4 vp;
+	size_t avail;
+	bool mipmapped;
+
+	ASSERT(hud != NULL);
+
+	src_tex = surf_tex_raw(hud);
+	w = surf_size(hud).x;
+	h = surf_size(hud).y;
+	monochrome = surf_monochrome(hud);
+	if (src_tex == 0)
+		return;
+	if (hud->flat.cache_tex != 0 &&
+	    hud->flat.cache_src_gen == hud->src.gen &&
+	    hud->flat.cache_w == w && hud->flat.cache_h == h &&
+	    hud->flat.cache_glow_key == glow_key &&
+	    hud->flat.cache_blur_radius == hud->snap->blur_radius &&
+	    vect3_same(hud->flat.cache_glow_color, hud->snap->glow_color) &&
+	    vect3_same(hud->flat.cache_monochrome, monochrome)) {
+		return;
+	}
+	glutils_debug_push(0, "hud_flat_cache_update");
+
+	/*
+	 * If we're over the memory budget, use a lower resolution cache.
+	 * The glow is blurry anyway, so this mostly softens the main pass.
+	 */
+	tex_w = w;
+	tex_h = h;
+	avail = mem_avail(hud,
+	    (size_t)hud->flat.cache_tex_w * hud->flat.cache_tex_h * 4);
+	while (w / tex_w < MAX_FLAT_CACHE_SCALE &&
+	    (size_t)tex_w * tex_h * 4 > avail) {
+		tex_w = MAX(tex_w / 2, 1);
+		tex_h = MAX(tex_h / 2, 1);
+	}
+	hud->flat.cache_w = w;
+	hud->flat.cache_h = h;
+
+	if (hud->flat.cache_tex_w != tex_w || hud->flat.cache_tex_h != tex_h) {
+		if (hud->flat.cache_fbo != 0)
+			glDeleteFramebuffers(1, &hud->flat.cache_fbo);
+		if (hud->flat.cache_tex != 0) {
+			glDeleteTextures(1, &hud->flat.cache_tex);
+			IF_TEXSZ(TEXSZ_FREE(hud_flat_tex, GL_RGBA,
+			    GL_UNSIGNED_BYTE, hud->flat.cache_tex_w,
+			    hud->flat.cache_tex_h));
+		}
+		hud->flat.cache_tex_w = tex_w;
+		hud->flat.cache_tex_h = tex_h;
+
+		glGenTextures(1, &hud->flat.cache_tex);
+		XPLMBindTexture2d(hud->flat.cache_tex, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+		    GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+		    GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+		    GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+		    GL_CLAMP_TO_EDGE);
+		IF_TEXSZ(TEXSZ_ALLOC(hud_flat_tex, GL_RGBA, GL_UNSIGNED_BYTE,
+		    tex_w, tex_h));
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, tex_w, tex_h, 0,
+		    GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		XPLMBindTexture2d(0, 0);
+
+		glGenFramebuffers(1, &hud->flat.cache_fbo);
+		glBindFramebufferEXT(GL_FRAMEBUFFER, hud->flat.cache_fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+		    GL_TEXTURE_2D, hud->flat.cache_tex, 0);
+		VERIFY3U(glCheckFramebufferStatus(GL_FRAMEBUFFER), ==,
+		    GL_FRAMEBUFFER_COMPLETE);
+	}
+	hud->flat.cache_src_gen = hud->src.gen;
+	hud->flat.cache_glow_key = glow_key;
+	hud->flat.cache_blur_radius = hud->snap->blur_radius;
+	hud->flat.cache_glow_color = hud->snap->glow_color;
+	hud->flat.cache_monochrome = monochrome;
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &old_fbo);
+	glGetIntegerv(GL_VIEWPORT, old_vp);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, hud->flat.cache_fbo);
+	glViewport(0, 0, tex_w, tex_h);
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	vp[0] = 0;
+	vp[1] = 0;
+	vp[2] = tex_w;
+	vp[3] = tex_h;
+	/* Flipped, so texture row 0 ends up in framebuffer row 0 */
+	glm_ortho(0, 1, 1, 0, -1, 1, pvm);
+	src_tex = surface_tex_get(hud, &mipmapped);
+	if (mipmapped) {
+		glow_key |= PROJ_MIPS;
+		main_key |= PROJ_MIPS;
+	}
+	draw_projection(hud, pvm, vp, glow_key, src_tex, VECT2(w, h), 1,
+	    hud->snap->glow_color, true);
+	draw_projection(hud, pvm, vp, main_key, src_tex, VECT2(w, h), 1,
+	    monochrome, true);
+
+	glBindFramebufferEXT(GL_FRAMEBUFFER, old_fbo);
+	glViewport(old_vp[0], old_vp[1], old_vp[2], old_vp[3]);
+
+	glutils_debug_pop();
+}
+
+/*
+ * Renders the projected symbology (including glow & brightness) flat
+ * into the viewport rect `vp' of the currently bound framebuffer. The
+ * caller must have set up the viewport. If `flip' is true, the image is
+ * rendered upside down, so that reading back the framebuffer produces
+ * rows in top-to-bottom order. With glow enabled, the glow is taken
+ * from the glow cache, so the main surface is always a single draw.
+ */
+static void
+render_flat(hud_t *hud, const vec4 vp, bool flip)
+{
+	mat4 pvm;
+	unsigned glow_key, main_key;
+	GLint saved_blend[4];
+	GLboolean saved_blend_on, saved_cull;
+	bool glow;
+
+	ASSERT(hud != NULL);
+	ASSERT(vp != NULL);
+
+	flat_init(hud);
+	glm_ortho(0, 1, flip ? 1 : 0, flip ? 0 : 1, -1, 1, pvm);
+	glow = proj_keys_select(hud, &glow_key, &main_key);
+
+	glGetIntegerv(GL_BLEND_SRC_RGB, &saved_blend[0]);
+	glGetIntegerv(GL_BLEND_DST_RGB, &saved_blend[1]);
+	glGetIntegerv(GL_BLEND_SRC_ALPHA, &saved_blend[2]);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &saved_blend[3]);
+	saved_blend_on = glIsEnabled(GL_BLEND);
+	saved_cull = glIsEnabled(GL_CULL_FACE);
+	/*
+	 * Accumulate the alpha channel correctly, so the result can be
+	 * composited by the consumer (as premultiplied RGBA). The glow
+	 * cache is premultiplied in either mode.
+	 */
+	glEnable(GL_BLEND);
+	if (hud->snap->premul) {
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	} else {
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+		    GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	glDisable(GL_CULL_FACE);
+
+	if (glow) {
+		flat_cache_update(hud, glow_key, main_key);
+		if (hud->flat.cache_tex != 0) {
+			draw_projection(hud, pvm, vp, main_key & PROJ_PREMUL,
+			    hud->flat.cache_tex, VECT2(hud->flat.cache_tex_w,
+			    hud->flat.cache_tex_h), hud->snap->brt, NULL_VECT3,
+			    true);
+		}
+	} else {
+		render_projection(hud, pvm, vp, main_key, false, true);
+	}
+	/* The conformal layer changes every frame, so it isn't cached */
+	if (hud->conf.active) {
+		if (glow)
+			render_conformal(hud, pvm, vp, glow_key, true, true);
+		render_conformal(hud, pvm, vp, main_key, false, true);
+	}
+
+	glBlendFuncSeparate(saved_blend[0], saved_blend[1],
+	    saved_blend[2], saved_blend[3]);
+	if (!saved_blend_on)
+		glDisable(GL_BLEND);
+	if (saved_cull)
+		glEnable(GL_CULL_FACE);
+}
+
+static void
+gov_step(hud_t *hud, double frame_time)
+{
+	ASSERT(hud != NULL);
+
+	hud->gov.since_recover++;
+	if (frame_time > hud->gov.budget) {
+		hud->gov.under = 0;
+		if (++hud->gov.over < GOV_DEGRADE_SAMPLES)
+			return;
+		if (hud->gov.level >= GOV_MAX_LEVEL) {
+			/* Out of degradations, only the app can help now */
+			hud->gov.surface_hint = true;
+			return;
+		}
+		/*
+		 * If we only just recovered into this level, the recovery
+		 * was premature, so back off on the next recovery attempt.
+		 */
+		if (hud->gov.since_recover < hud->gov.recover_hold) {
+			hud->gov.recover_hold = MIN(hud->gov.recover_hold * 2,
+			    GOV_RECOVER_SAMPLES_MAX);
+		}
+		hud->gov.level++;
+	} else if (frame_time < hud->gov.budget * GOV_RECOVER_FRAC) {
+		hud->gov.over = 0;
+		hud->gov.surface_hint = false;
+		if (++hud->gov.under < hud->gov.recover_hold ||
+		    hud->gov.level == HUD_QUALITY_FULL)
+			return;
+		hud->gov.level--;
+		hud->gov.since_recover = 0;
+	} else {
+		hud->gov.over = 0;
+		hud->gov.under = 0;
+		hud->gov.surface_hint = false;
+		if (hud->gov.since_recover > GOV_RECOVER_SAMPLES_MAX)
+			hud->gov.recover_hold = GOV_RECOVER_SAMPLES;
+		return;
+	}
+	/* Level changed, let the measurements settle for the new level */
+	hud->gov.over = 0;
+	hud->gov.under = 0;
+	hud->gov.eye_time = 0;
+}
+
+static void
+gov_reset(hud_t *hud, double budget)
+{
+	ASSERT(hud != NULL);
+	ASSERT3F(budget, >=, 0);
+
+	hud->gov.budget = budget;
+	hud->gov.over = 0;
+	hud->gov.under = 0;
+	hud->gov.recover_hold = GOV_RECOVER_SAMPLES;
+	hud->gov.since_recover = GOV_RECOVER_SAMPLES_MAX;
+	hud->gov.surface_hint = false;
+	if (budget == 0) {
+		hud->gov.level = HUD_QUALITY_FULL;
+		hud->gov.eye_time = 0;
+	}
+}
+
+/*
+ * Collects any GPU timing results which have become available and feeds
+ * them to the governor. Never waits on the GPU.
+ */
+static void
+gov_collect(hud_t *hud)
+{
+	unsigned num_eyes;
+
+	ASSERT(hud != NULL);
+
+	/* Direct hud_render_eye users might not have num_eyes set up */
+	num_eyes = MAX(hud->num_eyes, 1);
+	for (int i = 0; i < GOV_QUERY_RING; i++) {
+		GLint avail = 0;
+		GLuint64 t_start, t_end;
+		double eye_time;
+
+		if (!hud->gov.queries[i].pending)
+			continue;
+		glGetQueryObjectiv(hud->gov.queries[i].q[1],
+		    GL_QUERY_RESULT_AVAILABLE, &avail);
+		if (!avail)
+			continue;
+		glGetQueryObjectui64v(hud->gov.queries[i].q[0],
+		    GL_QUERY_RESULT, &t_start);
+		glGetQueryObjectui64v(hud->gov.queries[i].q[1],
+		    GL_QUERY_RESULT, &t_end);
+		hud->gov.queries[i].pending = false;
+		/*
+		 * The query was issued anyway, so GPU time is collected
+		 * even without LIBHUD_STATS.
+		 */
+		hud->stats.gpu_us += (t_end - t_start) / 1000;
+		hud->stats.gpu_samples++;
+		if (hud->gov.budget <= 0)
+			continue;
+
+		eye_time = (t_end - t_start) / 1000000.0;
+		if (hud->gov.eye_time == 0) {
+			hud->gov.eye_time = eye_time;
+		} else {
+			hud->gov.eye_time += (eye_time - hud->gov.eye_time) *
+			    GOV_EMA_ALPHA;
+		}
+		gov_step(hud, hud->gov.eye_time * num_eyes);
+	}
+}
+
+/*
+ * Starts a GPU timing measurement of the current eye render. Returns the
+ * query slot index, or -1 if no free slot was available (the GPU is
+ * lagging behind far enough that all slots are still pending).
+ */
+static int
+gov_begin(hud_t *hud)
+{
+	unsigned slot;
+
+	ASSERT(hud != NULL);
+
+#ifndef	LIBHUD_STATS
+	/* With stats enabled, we always measure GPU time */
+	if (hud->gov.budget <= 0)
+		return (-1);
+#endif
+	if (hud->gov.queries[0].q[0] == 0) {
+		for (int i = 0; i < GOV_QUERY_RING; i++)
+			glGenQueries(2, hud->gov.queries[i].q);
+	}
+	gov_collect(hud);
+
+	slot = hud->gov.next_query;
+	if (hud->gov.queries[slot].pending)
+		return (-1);
+	hud->gov.next_query = (slot + 1) % GOV_QUERY_RING;
+	glQueryCounter(hud->gov.queries[slot].q[0], GL_TIMESTAMP);
+
+	return (slot);
+}
+
+static void
+gov_end(hud_t *hud, int slot)
+{
+	ASSERT(hud != NULL);
+
+	if (slot < 0)
+		return;
+	ASSERT3S(slot, <, GOV_QUERY_RING);
+	glQueryCounter(hud->gov.queries[slot].q[1], GL_TIMESTAMP);
+	hud->gov.queries[slot].pending = true;
+}
+
+static void
+render_eye(hud_t *hud, const mat4 pvm, const vec4 vp)
+{
+	unsigned glow_key, main_key;
+	GLint saved_blend[4];
+	bool glow;
+	int gov_slot;
+
+	ASSERT(hud != NULL);
+	ASSERT(pvm != NULL);
+	ASSERT(vp != NULL);
+
+	if (hud->snap->gpu_budget != hud->gov.budget)
+		gov_reset(hud, hud->snap->gpu_budget);
+	/* Cheap once everything is built, as permutations are cached */
+	if (hud->gov.budget > 0)
+		(void) proj_shaders_prepare(hud);
+	glow = proj_keys_select(hud, &glow_key, &main_key);
+
+	glutils_debug_push(0, "hud_render");
+	ZONE_BEGIN(render);
+	STAT_INC(hud, eyes);
+	gov_slot = gov_begin(hud);
+
+	glEnable(GL_BLEND);
+
+	update_fbo(hud, vp);
+
+	/* Draw the glass stencil layer */
+	render_stencil(hud, pvm, vp);
+
+	/* Draw the opaque glass layer */
+	glDepthMask(GL_FALSE);
+	render_glass(hud, pvm);
+
+	/* Draw the actual collimated projection */
+	if (hud->snap->premul) {
+		glGetIntegerv(GL_BLEND_SRC_RGB, &saved_blend[0]);
+		glGetIntegerv(GL_BLEND_DST_RGB, &saved_blend[1]);
+		glGetIntegerv(GL_BLEND_SRC_ALPHA, &saved_blend[2]);
+		glGetIntegerv(GL_BLEND_DST_ALPHA, &saved_blend[3]);
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	if (glow) {
+		render_projection(hud, pvm, vp, glow_key, true, false);
+		if (hud->conf.active)
+			render_conformal(hud, pvm, vp, glow_key, true, false);
+	}
+	render_projection(hud, pvm, vp, main_key, false, false);
+	if (hud->conf.active)
+		render_conformal(hud, pvm, vp, main_key, false, false);
+	if (hud->snap->premul) {
+		glBlendFuncSeparate(saved_blend[0], saved_blend[1],
+		    saved_blend[2], saved_blend[3]);
+	}
+	glDepthMask(GL_TRUE);
+
+	gov_end(hud, gov_slot);
+	ZONE_END(hud, render);
+	glutils_debug_pop();
+}
+
+/**
+ * Allows invoking the HUD renderer with a custom projection-modelview
+ * matrix and viewport. If you are using `hud_set_enabled', you don't
+ * need to call this. Parameter changes made from other threads are
+ * picked up at the start of each call, so when rendering multiple eyes
+ * of the same frame, parameters could differ between the eyes if they
+ * are being changed concurrently.
+ */
+void
+hud_render_eye(hud_t *hud, const mat4 pvm, const vec4 vp)
+{
+	ASSERT(hud != NULL);
+	params_latch(hud);
+	frame_begin(hud);
+	render_eye(hud, pvm, vp);
+}
+
+/**
+ * Renders the HUD image flat into a 2D rect, e.g. for a HUD repeater
+ * display on an instructor station or cockpit panel. This applies the
+ * same brightness, monochrome tint and glow as the normal projection,
+ * but skips the combiner glass, stencil and 3D projection entirely. The
+ * glow is cached between surface updates, so each call costs a single
+ * textured quad. Must be called from the render thread.
+ *
+ * @param fbo Framebuffer object to render into. Pass 0 to render into
+ *	the default framebuffer. The previous framebuffer binding,
+ *	viewport, blending and depth test state are restored afterwards.
+ * @param rect The rect to render into, as {x, y, width, height} in
+ *	pixels, with the origin in the lower left corner.
+ */
+void
+hud_render_flat(hud_t *hud, GLuint fbo, const vec4 rect)
+{
+	GLint old_fbo, old_vp[4];
+
+	ASSERT(hud != NULL);
+	ASSERT(rect != NULL);
+
+	params_latch(hud);
+	frame_begin(hud);
+	glutils_debug_push(0, "hud_render_flat");
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &old_fbo);
+	glGetIntegerv(GL_VIEWPORT, old_vp);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, fbo);
+	glViewport(rect[0], rect[1], rect[2], rect[3]);
+
+	render_flat(hud, rect, false);
+
+	glBindFramebufferEXT(GL_FRAMEBUFFER, old_fbo);
+	glViewport(old_vp[0], old_vp[1], old_vp[2], old_vp[3]);
+
+	glutils_debug_pop();
+}
+
+static void
+rb_worker(void *arg)
+{
+	hud_t *hud = arg;
+
+	ASSERT(hud != NULL);
+	thread_set_name("hud_readback");
+
+	mutex_enter(&hud->rb.lock);
+	for (;;) {
+		unsigned idx;
+
+		while (hud->rb.q_len == 0 && !hud->rb.shutdown)
+			cv_wait(&hud->rb.cv, &hud->rb.lock);
+		if (hud->rb.shutdown)
+			break;
+		idx = hud->rb.queue[hud->rb.q_head];
+		hud->rb.q_head = (hud->rb.q_head + 1) % RB_NUM_PBOS;
+		hud->rb.q_len--;
+		ASSERT(hud->rb.busy[idx]);
+		/*
+		 * Drop the lock during the callback, the PBO remains ours
+		 * until we clear its busy flag.
+		 */
+		mutex_exit(&hud->rb.lock);
+		hud->rb.cb(hud->rb.pbos[idx].pixels, hud->rb.w, hud->rb.h,
+		    hud->rb.pbos[idx].frame, hud->rb.userinfo);
+		mutex_enter(&hud->rb.lock);
+		hud->rb.busy[idx] = false;
+	}
+	mutex_exit(&hud->rb.lock);
+}
+
+/*
+ * Hands a finished PBO to the worker. With persistently mapped PBOs,
+ * the worker reads the mapping directly. Otherwise we have to map the
+ * PBO here and copy it out, as the worker has no GL context.
+ */
+static void
+rb_deliver(hud_t *hud, unsigned pbo_idx)
+{
+	unsigned q_idx;
+
+	ASSERT(hud != NULL);
+	ASSERT3U(pbo_idx, <, RB_NUM_PBOS);
+
+	if (hud->rb.pbos[pbo_idx].copy != NULL) {
+		size_t sz = (size_t)hud->rb.w * hud->rb.h * 4;
+		const void *pixels;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, hud->rb.pbos[pbo_idx].pbo);
+		pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sz,
+		    GL_MAP_READ_BIT);
+		if (pixels != NULL) {
+			memcpy(hud->rb.pbos[pbo_idx].copy, pixels, sz);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		if (pixels == NULL)
+			return;
+	}
+
+	mutex_enter(&hud->rb.lock);
+	ASSERT(!hud->rb.busy[pbo_idx]);
+	ASSERT3U(hud->rb.q_len, <, RB_NUM_PBOS);
+	q_idx = (hud->rb.q_head + hud->rb.q_len) % RB_NUM_PBOS;
+	hud->rb.queue[q_idx] = pbo_idx;
+	hud->rb.q_len++;
+	hud->rb.busy[pbo_idx] = true;
+	cv_broadcast(&hud->rb.cv);
+	mutex_exit(&hud->rb.lock);
+}
+
+/*
+ * Delivers all in-flight PBOs whose fences have signaled, oldest first.
+ * Never waits on the GPU.
+ */
+static void
+rb_collect(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+
+	while (hud->rb.pbos[hud->rb.pbo_tail].fence != NULL) {
+		unsigned idx = hud->rb.pbo_tail;
+		GLenum res = glClientWaitSync(hud->rb.pbos[idx].fence, 0, 0);
+
+		if (res != GL_ALREADY_SIGNALED &&
+		    res != GL_CONDITION_SATISFIED)
+			break;
+		glDeleteSync(hud->rb.pbos[idx].fence);
+		hud->rb.pbos[idx].fence = NULL;
+		rb_deliver(hud, idx);
+		hud->rb.pbo_tail = (idx + 1) % RB_NUM_PBOS;
+	}
+}
+
+/**
+ * Reports the GPU memory used by the HUD's resources, broken down by
+ * resource. Program memory is only reported if the driver supports
+ * ARB_get_program_binary and is then only an estimate (the size of the
+ * linked program binaries). Must be called from the render thread.
+ */
+void
+hud_get_memory_usage(const hud_t *hud, hud_mem_usage_t *usage)
+{
+	ASSERT(hud != NULL);
+	ASSERT(usage != NULL);
+
+	mem_usage_compute(hud, usage);
+	if (GLEW_ARB_get_program_binary) {
+		GLuint progs[NUM_PROJ_SHADERS + 2];
+		unsigned n = 0;
+
+		progs[n++] = hud->stencil_shader.prog;
+		progs[n++] = hud->glass_shader.prog;
+		for (unsigned i = 0; i < NUM_PROJ_SHADERS; i++)
+			progs[n++] = hud->proj_shader[i].prog;
+		for (unsigned i = 0; i < n; i++) {
+			GLint len = 0;
+
+			if (progs[i] == 0)
+				continue;
+			glGetProgramiv(progs[i], GL_PROGRAM_BINARY_LENGTH,
+			    &len);
+			usage->programs += len;
+		}
+	}
+	usage->total += usage->programs;
+}
+
+/**
+ * Sets a GPU memory budget for the HUD's render targets. When creating
+ * or resizing a render target would exceed the budget, libhud instead
+ * falls back to a lower resolution stencil mask (down to 1/8 of the
+ * viewport size) and flat glow cache (down to 1/4 of the surface size),
+ * rather than keep growing. Memory which is directly requested by the
+ * application (such as the readback target) is never reduced, but does
+ * count towards the budget. Shader programs are not counted.
+ *
+ * @param bytes The budget in bytes. Pass 0 for no budget (the default).
+ */
+void
+hud_set_memory_budget(hud_t *hud, size_t bytes)
+{
+	ASSERT(hud != NULL);
+	params_enter(hud)->mem_budget = bytes;
+	params_exit(hud);
+}
+
+/**
+ * Returns the memory budget set using hud_set_memory_budget, or 0 if no
+ * budget has been set.
+ */
+size_t
+hud_get_memory_budget(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (params_get(hud).mem_budget);
+}
+
+/**
+ * Enables asynchronous readback of the composited HUD image, e.g. for
+ * recording HUD video or streaming it to an instructor station. Once per
+ * frame, the projected symbology (with glow & brightness applied, but
+ * without the combiner glass or 3D projection) is rendered into an
+ * offscreen target of size `w' x `h'. It is then read back through a
+ * ring of pixel buffer objects. Finished frames are handed to `cb' on a
+ * dedicated worker thread. The render thread never waits on the GPU or
+ * the consumer: if either falls behind, frames are dropped instead.
+ *
+ * Must be called from the render thread. If readback is already
+ * enabled, it is first disabled and then re-enabled with the new
+ * parameters.
+ *
+ * @param w Width of the readback image in pixels.
+ * @param h Height of the readback image in pixels.
+ * @param cb Consumer callback, see hud_readback_cb_t.
+ * @param userinfo Optional argument passed to `cb'.
+ *
+ * @return True on success, false if the offscreen target couldn't be
+ *	set up.
+ */
+bool
+hud_readback_enable(hud_t *hud, unsigned w, unsigned h,
+    hud_readback_cb_t cb, void *userinfo)
+{
+	GLint old_fbo;
+	size_t sz;
+
+	ASSERT(hud != NULL);
+	ASSERT(w != 0);
+	ASSERT(h != 0);
+	ASSERT(cb != NULL);
+
+	if (hud->rb.enabled)
+		hud_readback_disable(hud);
+
+	hud->rb.w = w;
+	hud->rb.h = h;
+	hud->rb.cb = cb;
+	hud->rb.userinfo = userinfo;
+	hud->rb.frame = 0;
+	hud->rb.pbo_head = 0;
+	hud->rb.pbo_tail = 0;
+	sz = (size_t)w * h * 4;
+
+	glGenTextures(1, &hud->rb.tex);
+	XPLMBindTexture2d(hud->rb.tex, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	IF_TEXSZ(TEXSZ_ALLOC(hud_readback_tex, GL_RGBA, GL_UNSIGNED_BYTE,
+	    w, h));
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA,
+	    GL_UNSIGNED_BYTE, NULL);
+	XPLMBindTexture2d(0, 0);
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &old_fbo);
+	glGenFramebuffers(1, &hud->rb.fbo);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, hud->rb.fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	    GL_TEXTURE_2D, hud->rb.tex, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		logMsg("Error setting up HUD readback target: incomplete "
+		    "framebuffer");
+		glBindFramebufferEXT(GL_FRAMEBUFFER, old_fbo);
+		glDeleteFramebuffers(1, &hud->rb.fbo);
+		hud->rb.fbo = 0;
+		glDeleteTextures(1, &hud->rb.tex);
+		IF_TEXSZ(TEXSZ_FREE(hud_readback_tex, GL_RGBA,
+		    GL_UNSIGNED_BYTE, w, h));
+		hud->rb.tex = 0;
+		return (false);
+	}
+	glBindFramebufferEXT(GL_FRAMEBUFFER, old_fbo);
+
+	/*
+	 * Where possible, the PBOs stay mapped for their whole lifetime,
+	 * so the worker can read finished frames straight out of them and
+	 * the render thread only ever issues the transfers.
+	 */
+	for (int i = 0; i < RB_NUM_PBOS; i++) {
+		const GLbitfield flags = GL_MAP_READ_BIT |
+		    GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		glGenBuffers(1, &hud->rb.pbos[i].pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, hud->rb.pbos[i].pbo);
+		IF_TEXSZ(TEXSZ_ALLOC_BYTES(hud_readback_pbo, sz));
+		hud->rb.pbos[i].fence = NULL;
+		hud->rb.pbos[i].pixels = NULL;
+		hud->rb.pbos[i].copy = NULL;
+		if (GLEW_ARB_buffer_storage) {
+			glBufferStorage(GL_PIXEL_PACK_BUFFER, sz, NULL, flags);
+			hud->rb.pbos[i].pixels = glMapBufferRange(
+			    GL_PIXEL_PACK_BUFFER, 0, sz, flags);
+		} else {
+			glBufferData(GL_PIXEL_PACK_BUFFER, sz, NULL,
+			    GL_STREAM_READ);
+		}
+		if (hud->rb.pbos[i].pixels == NULL) {
+			hud->rb.pbos[i].copy = safe_malloc(sz);
+			hud->rb.pbos[i].pixels = hud->rb.pbos[i].copy;
+		}
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	mutex_init(&hud->rb.lock);
+	cv_init(&hud->rb.cv);
+	hud->rb.shutdown = false;
+	hud->rb.q_head = 0;
+	hud->rb.q_len = 0;
+	for (int i = 0; i < RB_NUM_PBOS; i++)
+		hud->rb.busy[i] = false;
+	VERIFY(thread_create(&hud->rb.worker, rb_worker, hud));
+	hud->rb.enabled = true;
+
+	return (true);
+}
+
+/**
+ * Disables HUD readback previously enabled using hud_readback_enable.
+ * Frames still in flight on the GPU are discarded. Waits for the
+ * consumer callback to return if it is currently running. Must be
+ * called from the render thread.
+ */
+void
+hud_readback_disable(hud_t *hud)
+{
+	size_t sz;
+
+	ASSERT(hud != NULL);
+
+	if (!hud->rb.enabled)
+		return;
+	sz = (size_t)hud->rb.w * hud->rb.h * 4;
+
+	mutex_enter(&hud->rb.lock);
+	hud->rb.shutdown = true;
+	cv_broadcast(&hud->rb.cv);
+	mutex_exit(&hud->rb.lock);
+	thread_join(&hud->rb.worker);
+	mutex_destroy(&hud->rb.lock);
+	cv_destroy(&hud->rb.cv);
+
+	for (int i = 0; i < RB_NUM_PBOS; i++) {
+		if (hud->rb.pbos[i].fence != NULL) {
+			glDeleteSync(hud->rb.pbos[i].fence);
+			hud->rb.pbos[i].fence = NULL;
+		}
+		/* Deleting a persistently mapped PBO also unmaps it */
+		free(hud->rb.pbos[i].copy);
+		hud->rb.pbos[i].copy = NULL;
+		hud->rb.pbos[i].pixels = NULL;
+		glDeleteBuffers(1, &hud->rb.pbos[i].pbo);
+		IF_TEXSZ(TEXSZ_FREE_BYTES(hud_readback_pbo, sz));
+		hud->rb.pbos[i].pbo = 0;
+	}
+	glDeleteFramebuffers(1, &hud->rb.fbo);
+	hud->rb.fbo = 0;
+	glDeleteTextures(1, &hud->rb.tex);
+	IF_TEXSZ(TEXSZ_FREE(hud_readback_tex, GL_RGBA, GL_UNSIGNED_BYTE,
+	    hud->rb.w, hud->rb.h));
+	hud->rb.tex = 0;
+
+	hud->rb.enabled = false;
+}
+
+/**
+ * Returns true if HUD readback is enabled.
+ */
+bool
+hud_readback_is_enabled(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (hud->rb.enabled);
+}
+
+/**
+ * Captures a readback frame and delivers any previously captured frames
+ * which have finished transferring. When using `hud_set_enabled', this
+ * is done automatically at the end of each frame. When rendering using
+ * hud_render_eye directly, you should call this once per frame after
+ * rendering. If readback isn't enabled, this does nothing.
+ */
+void
+hud_readback_frame(hud_t *hud)
+{
+	unsigned idx;
+	GLint old_fbo, old_vp[4], old_align;
+	vec4 vp;
+	bool busy;
+
+	ASSERT(hud != NULL);
+
+	if (!hud->rb.enabled)
+		return;
+
+	rb_collect(hud);
+
+	idx = hud->rb.pbo_head;
+	mutex_enter(&hud->rb.lock);
+	busy = hud->rb.busy[idx];
+	mutex_exit(&hud->rb.lock);
+	if (hud->rb.pbos[idx].fence != NULL || busy) {
+		/* All PBOs in flight or with the consumer, drop this frame */
+		hud->rb.frame++;
+		return;
+	}
+	glutils_debug_push(0, "hud_readback");
+
+	old_fbo = dr_geti(&hud->drs.old_fbo);
+	STAT_INC(hud, dr_reads);
+	glGetIntegerv(GL_VIEWPORT, old_vp);
+	glBindFramebufferEXT(GL_FRAMEBUFFER, hud->rb.fbo);
+	glViewport(0, 0, hud->rb.w, hud->rb.h);
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	vp[0] = 0;
+	vp[1] = 0;
+	vp[2] = hud->rb.w;
+	vp[3] = hud->rb.h;
+	render_flat(hud, vp, true);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, hud->rb.pbos[idx].pbo);
+	glGetIntegerv(GL_PACK_ALIGNMENT, &old_align);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, hud->rb.w, hud->rb.h, GL_RGBA, GL_UNSIGNED_BYTE,
+	    NULL);
+	glPixelStorei(GL_PACK_ALIGNMENT, old_align);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	hud->rb.pbos[idx].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,
+	    0);
+	hud->rb.pbos[idx].frame = hud->rb.frame++;
+	hud->rb.pbo_head = (idx + 1) % RB_NUM_PBOS;
+
+	glBindFramebufferEXT(GL_FRAMEBUFFER, old_fbo);
+	glViewport(old_vp[0], old_vp[1], old_vp[2], old_vp[3]);
+
+	glutils_debug_pop();
+}
+
+/**
+ * Sets a GPU time budget for the HUD's rendering and enables the
+ * frame-time governor. The governor measures the GPU time spent in
+ * libhud's own render passes and, when it stays over budget, steps
+ * down through the quality levels in hud_quality_t. When enough
+ * headroom returns, it steps back up again, with hysteresis.
+ *
+ * @param budget_ms The GPU time budget in milliseconds for a whole frame
+ *	(i.e. for all eyes rendered in the frame). Pass 0 to disable the
+ *	governor and return to full quality.
+ */
+void
+hud_set_gpu_budget(hud_t *hud, double budget_ms)
+{
+	ASSERT(hud != NULL);
+	ASSERT3F(budget_ms, >=, 0);
+	params_enter(hud)->gpu_budget = budget_ms;
+	params_exit(hud);
+}
+
+/**
+ * Returns the GPU time budget set using hud_set_gpu_budget, or 0 if
+ * the frame-time governor is disabled (the default).
+ */
+double
+hud_get_gpu_budget(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (params_get(hud).gpu_budget);
+}
+
+/**
+ * Returns the quality level currently selected by the frame-time
+ * governor. The governor itself only steps down to
+ * HUD_QUALITY_STENCIL_HALF. If the HUD is still over budget there,
+ * libhud has exhausted the degradations it can make on its own and this
+ * returns HUD_QUALITY_SURFACE_REDUCED instead. The application should
+ * then switch to a lower-resolution surface (using hud_set_mtcr or
+ * hud_surface_enable) and switch back when a lower value is returned.
+ */
+hud_quality_t
+hud_get_quality(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	if (hud->gov.surface_hint)
+		return (HUD_QUALITY_SURFACE_REDUCED);
+	return (hud->gov.level);
+}
+
+/**
+ * Returns the smoothed GPU time in milliseconds spent per frame in the
+ * HUD's render passes, as measured by the frame-time governor. This is
+ * only measured while a GPU budget is set, otherwise returns 0.
+ */
+double
+hud_get_gpu_time(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (hud->gov.eye_time * MAX(hud->num_eyes, 1));
+}
+
+static void
+surf_init(surf_t *surf)
+{
+	ASSERT(surf != NULL);
+	mutex_init(&surf->lock);
+	cv_init(&surf->cv);
+	surf->pinned = SURF_NUM_BUFS;
+}
+
+static void
+surf_fini(surf_t *surf)
+{
+	ASSERT(surf != NULL);
+	ASSERT(!surf->enabled);
+	mutex_destroy(&surf->lock);
+	cv_destroy(&surf->cv);
+}
+
+/*
+ * Sets up `surf' with a size of `w' x `h' pixels. Returns false if the
+ * surface doesn't fit in the memory budget.
+ */
+static bool
+surf_alloc(hud_t *hud, surf_t *surf, unsigned w, unsigned h,
+    vect3_t monochrome)
+{
+	unsigned bpp, tiles_x, tiles_y, num_tiles;
+	size_t sz;
+
+	ASSERT(hud != NULL);
+	ASSERT(surf != NULL);
+	ASSERT(!surf->enabled);
+	ASSERT(w != 0);
+	ASSERT(h != 0);
+
+	bpp = (IS_NULL_VECT(monochrome) ? 4 : 1);
+	sz = (size_t)w * h * bpp;
+	/* The texture & an equally sized upload PBO */
+	if (2 * sz > mem_avail(hud, 0))
+		return (false);
+	tiles_x = (w + SURF_TILE - 1) / SURF_TILE;
+	tiles_y = (h + SURF_TILE - 1) / SURF_TILE;
+	num_tiles = tiles_x * tiles_y;
+
+	glGenTextures(1, &surf->tex);
+	XPLMBindTexture2d(surf->tex, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	if (bpp == 1) {
+		IF_TEXSZ(TEXSZ_ALLOC(hud_surf_tex, GL_RED, GL_UNSIGNED_BYTE,
+		    w, h));
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, w, h, 0, GL_RED,
+		    GL_UNSIGNED_BYTE, NULL);
+	} else {
+		IF_TEXSZ(TEXSZ_ALLOC(hud_surf_tex, GL_RGBA, GL_UNSIGNED_BYTE,
+		    w, h));
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_BGRA,
+		    GL_UNSIGNED_BYTE, NULL);
+	}
+	XPLMBindTexture2d(0, 0);
+
+	glGenBuffers(1, &surf->pbo);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, surf->pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, sz, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	IF_TEXSZ(TEXSZ_ALLOC_BYTES(hud_surf_pbo, sz));
+
+	surf->upload = safe_calloc(num_tiles, sizeof (*surf->upload));
+
+	/*
+	 * No submitter can be staging while the surface is disabled, so
+	 * we can set everything up before taking the lock & publishing it.
+	 */
+	surf->w = w;
+	surf->h = h;
+	surf->bpp = bpp;
+	surf->monochrome = monochrome;
+	surf->tiles_x = tiles_x;
+	surf->tiles_y = tiles_y;
+	for (int i = 0; i < SURF_NUM_BUFS; i++) {
+		surf->buf[i] = safe_calloc(sz, 1);
+		surf->stale[i] = safe_calloc(num_tiles,
+		    sizeof (*surf->stale[i]));
+	}
+	surf->back_dirty = safe_calloc(num_tiles, sizeof (*surf->back_dirty));
+	surf->back_tiles = safe_calloc(num_tiles, sizeof (*surf->back_tiles));
+	surf->back_num = 0;
+	surf->dirty = safe_malloc(num_tiles * sizeof (*surf->dirty));
+	/* Upload the cleared surface to initialize the texture */
+	for (unsigned i = 0; i < num_tiles; i++)
+		surf->dirty[i] = true;
+
+	mutex_enter(&surf->lock);
+	ASSERT(!surf->staging);
+	surf->front = 0;
+	surf->back = 1;
+	surf->pinned = SURF_NUM_BUFS;
+	surf->num_dirty = num_tiles;
+	surf->enabled = true;
+	mutex_exit(&surf->lock);
+
+	return (true);
+}
+
+/*
+ * Frees the resources of `surf'. Waits for any submission in progress.
+ */
+static void
+surf_free(surf_t *surf)
+{
+	size_t sz;
+
+	ASSERT(surf != NULL);
+
+	if (!surf->enabled)
+		return;
+
+	mutex_enter(&surf->lock);
+	while (surf->staging)
+		cv_wait(&surf->cv, &surf->lock);
+	ASSERT3U(surf->pinned, ==, SURF_NUM_BUFS);
+	surf->enabled = false;
+	surf->num_dirty = 0;
+	mutex_exit(&surf->lock);
+	/* New submitters now see the surface disabled & back off */
+	for (int i = 0; i < SURF_NUM_BUFS; i++) {
+		free(surf->buf[i]);
+		surf->buf[i] = NULL;
+		free(surf->stale[i]);
+		surf->stale[i] = NULL;
+	}
+	free(surf->dirty);
+	surf->dirty = NULL;
+	free(surf->back_dirty);
+	surf->back_dirty = NULL;
+	free(surf->back_tiles);
+	surf->back_tiles = NULL;
+	surf->back_num = 0;
+
+	sz = (size_t)surf->w * surf->h * surf->bpp;
+	glDeleteBuffers(1, &surf->pbo);
+	surf->pbo = 0;
+	IF_TEXSZ(TEXSZ_FREE_BYTES(hud_surf_pbo, sz));
+	glDeleteTextures(1, &surf->tex);
+	surf->tex = 0;
+	if (surf->bpp == 1) {
+		IF_TEXSZ(TEXSZ_FREE(hud_surf_tex, GL_RED, GL_UNSIGNED_BYTE,
+		    surf->w, surf->h));
+	} else {
+		IF_TEXSZ(TEXSZ_FREE(hud_surf_tex, GL_RGBA, GL_UNSIGNED_BYTE,
+		    surf->w, surf->h));
+	}
+	free(surf->upload);
+	surf->upload = NULL;
+}
+
+/*
+ * Copies surface tile `tile' from `pixels' into the back buffer and
+ * marks it changed. With `compare' set, tiles which are identical to the
+ * latest submission are skipped. Must be called with `staging' set, but
+ * without holding the lock. Only the staging submitter changes `back',
+ * so we can read it unlocked.
+ */
+static void
+surf_tile_stage(surf_t *surf, const uint8_t *pixels, size_t stride,
+    unsigned tile, bool compare)
+{
+	unsigned x, y, tw, th, bpp;
+	uint8_t *back;
+
+	ASSERT(surf != NULL);
+	ASSERT(pixels != NULL);
+
+	if (surf->back_dirty[tile])
+		return;
+	surf_tile_rect(surf, tile, &x, &y, &tw, &th);
+	bpp = surf->bpp;
+	back = surf->buf[surf->back];
+	if (compare) {
+		bool same = true;
+
+		for (unsigned row = 0; row < th && same; row++) {
+			same = (memcmp(&back[((size_t)(y + row) *
+			    surf->w + x) * bpp], &pixels[(y + row) * stride +
+			    x * bpp], tw * bpp) == 0);
+		}
+		if (same)
+			return;
+	}
+	for (unsigned row = 0; row < th; row++) {
+		memcpy(&back[((size_t)(y + row) * surf->w + x) * bpp],
+		    &pixels[(y + row) * stride + x * bpp], tw * bpp);
+	}
+	surf->back_dirty[tile] = true;
+	surf->back_tiles[surf->back_num++] = tile;
+}
+
+/*
+ * Publishes the tiles staged in the back buffer by making it the front
+ * buffer, together with the attitude `att' they were rendered at (if
+ * not NULL). The new back buffer is whichever remaining buffer the
+ * render thread isn't uploading from. Then, with the lock released,
+ * brings the new back buffer up to date, so it holds the latest
+ * submission again. Must be called with `staging' set.
+ */
+static void
+surf_publish(surf_t *surf, const vect3_t *att)
+{
+	unsigned old_front, front, back;
+
+	ASSERT(surf != NULL);
+
+	mutex_enter(&surf->lock);
+	ASSERT(surf->staging);
+	if (att != NULL)
+		surf->att = *att;
+	if (surf->back_num == 0) {
+		mutex_exit(&surf->lock);
+		return;
+	}
+	old_front = surf->front;
+	surf->front = surf->back;
+	/* Reuse the old front buffer, unless it's being uploaded from */
+	back = old_front;
+	if (back == surf->pinned) {
+		back = 0;
+		while (back == surf->front || back == old_front)
+			back++;
+	}
+	ASSERT3U(back, <, SURF_NUM_BUFS);
+	surf->back = back;
+	front = surf->front;
+	for (unsigned i = 0; i < surf->back_num; i++) {
+		unsigned tile = surf->back_tiles[i];
+
+		if (!surf->dirty[tile]) {
+			surf->dirty[tile] = true;
+			surf->num_dirty++;
+		}
+	}
+	mutex_exit(&surf->lock);
+
+	/* All other buffers are now out of date in the published tiles */
+	for (unsigned i = 0; i < surf->back_num; i++) {
+		unsigned tile = surf->back_tiles[i];
+
+		for (unsigned b = 0; b < SURF_NUM_BUFS; b++) {
+			if (b != front)
+				surf->stale[b][tile] = true;
+		}
+		surf->back_dirty[tile] = false;
+	}
+	surf->back_num = 0;
+	/*
+	 * The render thread only ever reads from the front buffer and
+	 * never uses the back buffer, so we can do this unlocked.
+	 */
+	for (unsigned tile = 0; tile < surf->tiles_x * surf->tiles_y;
+	    tile++) {
+		unsigned x, y, tw, th;
+
+		if (!surf->stale[back][tile])
+			continue;
+		surf_tile_rect(surf, tile, &x, &y, &tw, &th);
+		for (unsigned row = 0; row < th; row++) {
+			size_t off = ((size_t)(y + row) * surf->w + x) *
+			    surf->bpp;
+
+			memcpy(&surf->buf[back][off], &surf->buf[front][off],
+			    tw * surf->bpp);
+		}
+		surf->stale[back][tile] = false;
+	}
+}
+
+/*
+ * Stages & publishes a submission to `surf', see hud_surface_submit.
+ * `att' is optional, see surf_publish. Concurrent submissions wait for
+ * each other. Returns false if the surface isn't enabled.
+ */
+static bool
+surf_submit(surf_t *surf, const uint8_t *pixels, size_t stride,
+    const hud_rect_t *rects, unsigned num_rects, const vect3_t *att)
+{
+	unsigned w, h;
+
+	ASSERT(surf != NULL);
+	ASSERT(pixels != NULL);
+	ASSERT(rects != NULL || num_rects == 0);
+
+	mutex_enter(&surf->lock);
+	while (surf->enabled && surf->staging)
+		cv_wait(&surf->cv, &surf->lock);
+	if (!surf->enabled) {
+		mutex_exit(&surf->lock);
+		return (false);
+	}
+	surf->staging = true;
+	mutex_exit(&surf->lock);
+
+	w = surf->w;
+	h = surf->h;
+	ASSERT3U(stride, >=, w * surf->bpp);
+	if (rects == NULL) {
+		for (unsigned i = 0; i < surf->tiles_x * surf->tiles_y; i++)
+			surf_tile_stage(surf, pixels, stride, i, true);
+	}
+	for (unsigned i = 0; i < num_rects; i++) {
+		const hud_rect_t *r = &rects[i];
+
+		if (r->w == 0 || r->h == 0 || r->x >= w || r->y >= h)
+			continue;
+		for (unsigned ty = r->y / SURF_TILE;
+		    ty <= (MIN(r->y + r->h, h) - 1) / SURF_TILE; ty++) {
+			for (unsigned tx = r->x / SURF_TILE;
+			    tx <= (MIN(r->x + r->w, w) - 1) / SURF_TILE;
+			    tx++) {
+				surf_tile_stage(surf, pixels, stride,
+				    ty * surf->tiles_x + tx, false);
+			}
+		}
+	}
+	surf_publish(surf, att);
+
+	mutex_enter(&surf->lock);
+	surf->staging = false;
+	cv_broadcast(&surf->cv);
+	mutex_exit(&surf->lock);
+
+	return (true);
+}
+
+/**
+ * Switches the HUD to a libhud-owned surface of size `w' x `h', which
+ * is used instead of the mt_cairo_render surface until it is disabled
+ * again. Contents are provided using hud_surface_submit and only the
+ * parts which changed are uploaded to the GPU, so a mostly static HUD
+ * (e.g. where only the speed or altitude tape moves) costs a fraction
+ * of the upload bandwidth of re-uploading the whole surface on every
+ * update. The surface starts out fully transparent.
+ *
+ * Must be called from the render thread. If the surface is already
+ * enabled, it is first disabled and then re-enabled with the new
+ * parameters. Waits for any hud_surface_submit call in progress.
+ *
+ * @param monochrome If NULL_VECT3, the surface holds premultiplied
+ *	32-bit ARGB pixels (as in a CAIRO_FORMAT_ARGB32 image surface).
+ *	Otherwise the surface holds 8-bit intensity pixels, which are
+ *	tinted using this color, as with mt_cairo_render_set_monochrome.
+ *
+ * @return True on success, false if the surface (a texture and an
+ *	equally sized upload buffer) doesn't fit in the memory budget set
+ *	using hud_set_memory_budget. The HUD then keeps using the
+ *	mt_cairo_render surface.
+ */
+bool
+hud_surface_enable(hud_t *hud, unsigned w, unsigned h, vect3_t monochrome)
+{
+	ASSERT(hud != NULL);
+	ASSERT(w != 0);
+	ASSERT(h != 0);
+
+	if (hud->surf.enabled)
+		hud_surface_disable(hud);
+	return (surf_alloc(hud, &hud->surf, w, h, monochrome));
+}
+
+/**
+ * Switches the HUD back to the mt_cairo_render surface and frees the
+ * libhud-owned surface. Must be called from the render thread. Waits
+ * for any hud_surface_submit call in progress.
+ */
+void
+hud_surface_disable(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	surf_free(&hud->surf);
+}
+
+/**
+ * Returns true if the libhud-owned surface is enabled.
+ * See hud_surface_enable.
+ */
+bool
+hud_surface_is_enabled(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (hud->surf.enabled);
+}
+
+/**
+ * Submits new contents for the libhud-owned surface. This may be called
+ * from any thread, typically the producer's render thread right after it
+ * has finished drawing a frame. Changed areas are tracked in tiles of
+ * 64x64 pixels, which are staged here and uploaded by the render thread
+ * at the start of the next HUD frame. A submission becomes visible all
+ * at once, so the HUD never shows a mix of two submissions. Calls from
+ * multiple threads are serialized. Has no effect if the surface isn't
+ * enabled (see hud_surface_enable).
+ *
+ * @param pixels The full surface contents in the format set up by
+ *	hud_surface_enable, starting with the top row.
+ * @param stride Length of one row of `pixels' in bytes.
+ * @param rects Optional list of `num_rects' rectangles which contain
+ *	all changes since the previous submission. Only the tiles touched
+ *	by these areas are read from `pixels'. If you pass NULL, libhud
+ *	instead compares the whole surface to the previous submission
+ *	to find the changed tiles. This runs on the calling thread.
+ * @param num_rects Number of elements in `rects'.
+ */
+void
+hud_surface_submit(hud_t *hud, const uint8_t *pixels, size_t stride,
+    const hud_rect_t *rects, unsigned num_rects)
+{
+	ASSERT(hud != NULL);
+	(void) surf_submit(&hud->surf, pixels, stride, rects, num_rects,
+	    NULL);
+}
+
+/**
+ * Enables an optional conformal symbology layer (horizon, pitch ladder,
+ * flight path vector, etc.), which is drawn on top of the main surface.
+ * This is a second libhud-owned surface (see hud_surface_enable), whose
+ * contents are submitted together with the aircraft attitude they were
+ * rendered at (see hud_conformal_submit). On every frame, libhud shifts
+ * & rotates the layer from that attitude to the aircraft's current
+ * attitude. This lets the conformal symbols track the outside world
+ * smoothly, even if the layer is re-rendered at a much lower rate than
+ * the display refresh rate (e.g. in VR). The reprojection uses a
+ * small-angle approximation, so it is only meant to cover the attitude
+ * change over a few frames.
+ *
+ * Must be called from the render thread. If the layer is already
+ * enabled, it is first disabled and then re-enabled with the new
+ * parameters.
+ *
+ * @param w Width of the layer in pixels. The layer must have the same
+ *	mapping onto the projection object as the main surface.
+ * @param h Height of the layer in pixels.
+ * @param monochrome Surface format, see hud_surface_enable.
+ * @param px_per_deg Angular scale of the layer in surface pixels per
+ *	degree of pitch or heading change.
+ * @param center Position of the boresight (the point around which
+ *	roll rotates the symbology) in surface pixels, with the origin
+ *	in the top left corner.
+ *
+ * @return True on success, false if the layer doesn't fit in the memory
+ *	budget set using hud_set_memory_budget.
+ */
+bool
+hud_conformal_enable(hud_t *hud, unsigned w, unsigned h, vect3_t monochrome,
+    double px_per_deg, vect2_t center)
+{
+	ASSERT(hud != NULL);
+	ASSERT(w != 0);
+	ASSERT(h != 0);
+	ASSERT3F(px_per_deg, >, 0);
+
+	if (hud->conf.surf.enabled)
+		hud_conformal_disable(hud);
+	if (!surf_alloc(hud, &hud->conf.surf, w, h, monochrome))
+		return (false);
+	hud->conf.px_per_deg = px_per_deg;
+	hud->conf.center = center;
+
+	return (true);
+}
+
+/**
+ * Removes the conformal layer enabled using hud_conformal_enable. Must
+ * be called from the render thread. Waits for any hud_conformal_submit
+ * call in progress.
+ */
+void
+hud_conformal_disable(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	surf_free(&hud->conf.surf);
+	hud->conf.active = false;
+}
+
+/**
+ * Returns true if the conformal layer is enabled.
+ * See hud_conformal_enable.
+ */
+bool
+hud_conformal_is_enabled(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (hud->conf.surf.enabled);
+}
+
+/**
+ * Submits new contents for the conformal layer, along with the aircraft
+ * attitude they were rendered at. This works like hud_surface_submit
+ * and may likewise be called from any thread. The attitude is published
+ * atomically with the pixels, so the layer is always reprojected from
+ * the attitude its displayed contents were actually rendered at. Has no
+ * effect if the layer isn't enabled (see hud_conformal_enable).
+ *
+ * @param pitch Pitch angle in degrees (sim/flightmodel/position/theta).
+ * @param roll Roll angle in degrees (sim/flightmodel/position/phi).
+ * @param hdg True heading in degrees (sim/flightmodel/position/psi).
+ */
+void
+hud_conformal_submit(hud_t *hud, const uint8_t *pixels, size_t stride,
+    const hud_rect_t *rects, unsigned num_rects, double pitch, double roll,
+    double hdg)
+{
+	vect3_t att = VECT3(pitch, roll, hdg);
+
+	ASSERT(hud != NULL);
+	(void) surf_submit(&hud->conf.surf, pixels, stride, rects,
+	    num_rects, &att);
+}
+
+/**
+ * Starts recording a HUD trace. While recording, every frame rendered by
+ * the HUD's draw callback appends the captured projection & aircraft
+ * matrices, viewports, reverse-Y/Z flags, FSAA ratios and HUD
+ * parameters to the trace file, as well as a checksum of the surface
+ * contents whenever they change. The trace can later be fed back
+ * through hud_render_eye outside of X-Plane using the replay functions
+ * in hud_trace.h (see bench/hud_replay.c). Frames rendered by calling
+ * hud_render_eye directly are not recorded. The conformal layer is not
+ * recorded.
+ *
+ * The render thread never waits on the GPU or the disk while recording.
+ * The surface is read back asynchronously and the trace file is written
+ * on a separate thread. Surface changes which occur while the previous
+ * readback is still in progress are coalesced. Each readback still
+ * costs a full surface transfer, so GPU timings are somewhat perturbed
+ * while recording. Must be called from the render thread.
+ *
+ * @param filename Path to the trace file to write. Any existing file
+ *	is overwritten. If a trace is already being recorded, it is
+ *	stopped first.
+ * @param surf_pixels If true, the full surface contents are recorded
+ *	along with each checksum, so that a replay shows the actual
+ *	symbology. This makes the trace much larger (up to 16 MB per
+ *	surface change for a 2048x2048 RGBA surface), so only enable it
+ *	if you need it.
+ *
+ * @return True if recording was started, false if the trace file
+ *	couldn't be created (the error is logged).
+ */
+bool
+hud_trace_start(hud_t *hud, const char *filename, bool surf_pixels)
+{
+	const hud_trace_hdr_t hdr = {
+	    .magic = HUD_TRACE_MAGIC,
+	    .version = HUD_TRACE_VERSION
+	};
+
+	ASSERT(hud != NULL);
+	ASSERT(filename != NULL);
+
+	if (hud->trace.fp != NULL)
+		hud_trace_stop(hud);
+	hud->trace.fp = fopen(filename, "wb");
+	if (hud->trace.fp == NULL) {
+		logMsg("Can't create HUD trace %s: %s", filename,
+		    strerror(errno));
+		return (false);
+	}
+	if (fwrite(&hdr, sizeof (hdr), 1, hud->trace.fp) != 1) {
+		logMsg("Error writing HUD trace %s: %s", filename,
+		    strerror(errno));
+		fclose(hud->trace.fp);
+		hud->trace.fp = NULL;
+		return (false);
+	}
+	hud->trace.pixels = surf_pixels;
+	hud->trace.frame = 0;
+	hud->trace.src_gen = 0;
+
+	mutex_init(&hud->trace.lock);
+	cv_init(&hud->trace.cv);
+	hud->trace.shutdown = false;
+	hud->trace.failed = false;
+	hud->trace.pbo_busy = false;
+	hud->trace.q_head = NULL;
+	hud->trace.q_tail = NULL;
+	VERIFY(thread_create(&hud->trace.writer, trace_writer, hud));
+
+	return (true);
+}
+
+/**
+ * Stops a HUD trace recording started using hud_trace_start. If no
+ * trace is being recorded, this does nothing. Waits for the trace
+ * writer to write out the records queued so far. A surface readback
+ * still in flight on the GPU is discarded. Must be called from the
+ * render thread.
+ */
+void
+hud_trace_stop(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	if (hud->trace.fp == NULL)
+		return;
+
+	mutex_enter(&hud->trace.lock);
+	hud->trace.shutdown = true;
+	cv_broadcast(&hud->trace.cv);
+	mutex_exit(&hud->trace.lock);
+	thread_join(&hud->trace.writer);
+	ASSERT3P(hud->trace.q_head, ==, NULL);
+	mutex_destroy(&hud->trace.lock);
+	cv_destroy(&hud->trace.cv);
+
+	if (hud->trace.fence != NULL) {
+		glDeleteSync(hud->trace.fence);
+		hud->trace.fence = NULL;
+	}
+	if (hud->trace.pbo != 0) {
+		glDeleteBuffers(1, &hud->trace.pbo);
+		IF_TEXSZ(TEXSZ_FREE_BYTES(hud_trace_pbo, hud->trace.pbo_sz));
+		hud->trace.pbo = 0;
+	}
+	hud->trace.pbo_sz = 0;
+	hud->trace.pbo_map = NULL;
+	free(hud->trace.copy);
+	hud->trace.copy = NULL;
+	fclose(hud->trace.fp);
+	hud->trace.fp = NULL;
+}
+
+/**
+ * Returns true if a HUD trace is currently being recorded.
+ */
+bool
+hud_trace_is_active(const hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	return (hud->trace.fp != NULL);
+}
+
+/**
+ * Retrieves the HUD's cumulative rendering counters. To obtain per-frame
+ * values, sample the counters periodically and subtract the previous
+ * sample. The counters are only collected when libhud is built with
+ * LIBHUD_STATS defined and are zero otherwise, except for gpu_us &
+ * gpu_samples, which are also collected while the frame-time governor
+ * is active (see hud_set_gpu_budget).
+ *
+ * @param hud The HUD object whose counters to read.
+ * @param stats Output structure which will be filled with the counters.
+ *
+ * @return True if libhud was built with LIBHUD_STATS, false if only
+ *	the GPU time is available.
+ */
+bool
+hud_get_stats(const hud_t *hud, hud_stats_t *stats)
+{
+	ASSERT(hud != NULL);
+	ASSERT(stats != NULL);
+	*stats = hud->stats;
+#ifdef	LIBHUD_STATS
+	return (true);
+#else	/* !defined(LIBHUD_STATS) */
+	return (false);
+#endif	/* !defined(LIBHUD_STATS) */
+}
+
+/**
+ * Resets all of the HUD's rendering counters back to zero.
+ */
+void
+hud_reset_stats(hud_t *hud)
+{
+	ASSERT(hud != NULL);
+	memset(&hud->stats, 0, sizeof (hud->stats));
+}
+
+/**
+ * Formats a stats structure as a single-line JSON object, suitable for
+ * logging benchmark results in a machine-readable format. To compare
+ * builds, collect the stats over a fixed number of frames (resetting
+ * them with hud_reset_stats beforehand) and divide by `frames' (or
+ * `gpu_samples' for gpu_us).
+ *
+ * @param stats The stats to format, as returned by hud_get_stats.
+ * @param buf Output buffer for the formatted string. May be NULL if
+ *	`cap' is 0, to determine the required buffer size.
+ * @param cap Capacity of `buf' in bytes.
+ *
+ * @return The length of the full formatted string (excluding the
+ *	terminating NUL), in the same manner as snprintf.
+ */
+size_t
+hud_stats_fmt_json(const hud_stats_t *stats, char *buf, size_t cap)
+{
+	int l;
+
+	ASSERT(stats != NULL);
+	ASSERT(buf != NULL || cap == 0);
+
+	l = snprintf(buf, cap, "{\"frames\":%llu,\"eyes\":%llu,"
+	    "\"draw_calls\":%llu,\"uniform_uploads\":%llu,"
+	    "\"prog_binds\":%llu,\"fbo_rebuilds\":%llu,\"dr_reads\":%llu,"
+	    "\"capture_us\":%llu,\"stencil_us\":%llu,\"glass_us\":%llu,"
+	    "\"proj_us\":%llu,\"render_us\":%llu,\"gpu_us\":%llu,"
+	    "\"gpu_samples\":%llu,\"surf_tiles\":%llu,"
+	    "\"surf_upload_bytes\":%llu}",
+	    (unsigned long long)stats->frames,
+	    (unsigned long long)stats->eyes,
+	    (unsigned long long)stats->draw_calls,
+	    (unsigned long long)stats->uniform_uploads,
+	    (unsigned long long)stats->prog_binds,
+	    (unsigned long long)stats->fbo_rebuilds,
+	    (unsigned long long)stats->dr_reads,
+	    (unsigned long long)stats->capture_us,
+	    (unsigned long long)stats->stencil_us,
+	    (unsigned long long)stats->glass_us,
+	    (unsigned long long)stats->proj_us,
+	    (unsigned long long)stats->render_us,
+	    (unsigned long long)stats->gpu_us,
+	    (unsigned long long)stats->gpu_samples,
+	    (unsigned long long)stats->surf_tiles,
+	    (unsigned long long)stats->surf_upload_bytes);
+	ASSERT3S(l, >=, 0);
+
+	return (l);
+}
+
+/**
+ * Installs a callback which is invoked at the end of each timed trace
+ * zone in the HUD's frame path (capture, stencil, glass, proj & render),
+ * so the zones can be fed into an external frame profiler. The callback
+ * receives the zone name and its start & end times as returned by
+ * microclock(). Zones are only emitted when libhud is built with
+ * LIBHUD_STATS defined, otherwise the callback is never called.
+ * Pass NULL for `cb' to remove a previously installed callback.
+ */
+void
+hud_set_trace_cb(hud_t *hud, hud_trace_cb_t cb, void *userinfo)
+{
+	ASSERT(hud != NULL);
+	hud->trace_cb = cb;
+	hud->trace_userinfo = userinfo;
 }
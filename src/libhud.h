@@ -20,6 +20,8 @@
 #define	_LIBHUD_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <acfutils/mt_cairo_render.h>
 #include <librain.h>
@@ -30,6 +32,92 @@ extern "C" {
 
 typedef struct hud_s hud_t;
 
+/*
+ * Cumulative counters collected by the HUD renderer. The counters are
+ * only collected when libhud is built with LIBHUD_STATS defined, so
+ * they cost nothing otherwise. The exception is the GPU time (gpu_us &
+ * gpu_samples), which is also collected while the frame-time governor
+ * is active, as it is measured anyway. All time values are in
+ * microseconds. The *_us values are CPU times, except
+ * for gpu_us, which is the GPU time of gpu_samples eye renders (GPU
+ * timing results arrive a few frames late and an eye render is skipped
+ * if the GPU is too far behind to have a timing query free).
+ * See hud_get_stats.
+ */
+typedef struct {
+	uint64_t	frames;		/* draw callback invocations */
+	uint64_t	eyes;		/* hud_render_eye invocations */
+	/* obj8 draw group & flat quad submissions, not GL draws */
+	uint64_t	draw_calls;
+	uint64_t	uniform_uploads;
+	uint64_t	prog_binds;
+	uint64_t	fbo_rebuilds;
+	uint64_t	dr_reads;
+	uint64_t	capture_us;
+	uint64_t	stencil_us;
+	uint64_t	glass_us;
+	uint64_t	proj_us;
+	uint64_t	render_us;
+	uint64_t	gpu_us;
+	uint64_t	gpu_samples;
+	uint64_t	surf_tiles;	/* dirty surface tiles uploaded */
+	uint64_t	surf_upload_bytes;
+} hud_stats_t;
+
+/*
+ * Quality levels stepped through by the frame-time governor (see
+ * hud_set_gpu_budget). Each level includes the degradations of all
+ * levels before it. HUD_QUALITY_SURFACE_REDUCED is not a level libhud
+ * steps into itself, it is a hint to the application (see
+ * hud_get_quality).
+ */
+typedef enum {
+    HUD_QUALITY_FULL,		/* everything as configured */
+    HUD_QUALITY_GLOW_REDUCED,	/* 9-tap glow instead of 25-tap */
+    HUD_QUALITY_GLOW_OFF,	/* glow pass skipped */
+    HUD_QUALITY_STENCIL_HALF,	/* stencil mask at half resolution */
+    HUD_QUALITY_SURFACE_REDUCED,	/* app hint only */
+    HUD_NUM_QUALITY_LEVELS
+} hud_quality_t;
+
+/*
+ * Consumer callback for hud_readback_enable. Called on the readback
+ * worker thread. `pixels' points to `w' x `h' premultiplied RGBA8 pixels
+ * in top-to-bottom row order, with rows `w' * 4 bytes apart. The buffer
+ * is only valid for the duration of the callback. `frame' is a sequence
+ * number which increments for every frame captured, so gaps in it show
+ * frames dropped because the consumer wasn't keeping up.
+ */
+typedef void (*hud_readback_cb_t)(const uint8_t *pixels, unsigned w,
+    unsigned h, uint64_t frame, void *userinfo);
+
+/*
+ * GPU memory used by a HUD's resources in bytes, see hud_get_memory_usage.
+ */
+typedef struct {
+	size_t		stencil;	/* combiner glass stencil mask */
+	size_t		flat;		/* flat render & its glow cache */
+	size_t		mips;		/* mipmapped surface copy */
+	size_t		surface;	/* libhud-owned surfaces & PBOs */
+	size_t		readback;	/* readback target & PBOs */
+	size_t		programs;	/* linked shader program binaries */
+	size_t		total;
+} hud_mem_usage_t;
+
+/*
+ * A rectangle on the HUD surface in pixels, with the origin in the top
+ * left corner. See hud_surface_submit.
+ */
+typedef struct {
+	unsigned	x;
+	unsigned	y;
+	unsigned	w;
+	unsigned	h;
+} hud_rect_t;
+
+typedef void (*hud_trace_cb_t)(const char *zone, uint64_t start_us,
+    uint64_t end_us, void *userinfo);
+
 hud_t *hud_new(const char *shader_dir, mt_cairo_render_t *mtcr,
     double glass_opacity, obj8_t *glass, const char *glass_group_id,
     obj8_t *proj, const char *proj_group_id);
@@ -50,10 +138,60 @@ double hud_get_glass_opacity(const hud_t *hud);
 void hud_set_depth_test(hud_t *hud, bool flag);
 bool hud_get_depth_test(const hud_t *hud);
 
+void hud_set_premultiplied(hud_t *hud, bool flag);
+bool hud_get_premultiplied(const hud_t *hud);
+
+void hud_set_surface_mips(hud_t *hud, bool flag);
+bool hud_get_surface_mips(const hud_t *hud);
+
+void hud_set_stencil_scale(hud_t *hud, unsigned divisor);
+unsigned hud_get_stencil_scale(const hud_t *hud);
+
 void hud_set_mtcr(hud_t *hud, mt_cairo_render_t *mtcr);
 mt_cairo_render_t *hud_get_mtcr(const hud_t *hud);
+bool hud_params_pending(const hud_t *hud);
 
 void hud_render_eye(hud_t *hud, const mat4 pvm, const vec4 vp);
+void hud_render_flat(hud_t *hud, GLuint fbo, const vec4 rect);
+
+void hud_set_gpu_budget(hud_t *hud, double budget_ms);
+double hud_get_gpu_budget(const hud_t *hud);
+hud_quality_t hud_get_quality(const hud_t *hud);
+double hud_get_gpu_time(const hud_t *hud);
+
+void hud_get_memory_usage(const hud_t *hud, hud_mem_usage_t *usage);
+void hud_set_memory_budget(hud_t *hud, size_t bytes);
+size_t hud_get_memory_budget(const hud_t *hud);
+
+bool hud_readback_enable(hud_t *hud, unsigned w, unsigned h,
+    hud_readback_cb_t cb, void *userinfo);
+void hud_readback_disable(hud_t *hud);
+bool hud_readback_is_enabled(const hud_t *hud);
+void hud_readback_frame(hud_t *hud);
+
+bool hud_surface_enable(hud_t *hud, unsigned w, unsigned h,
+    vect3_t monochrome);
+void hud_surface_disable(hud_t *hud);
+bool hud_surface_is_enabled(const hud_t *hud);
+void hud_surface_submit(hud_t *hud, const uint8_t *pixels, size_t stride,
+    const hud_rect_t *rects, unsigned num_rects);
+
+bool hud_conformal_enable(hud_t *hud, unsigned w, unsigned h,
+    vect3_t monochrome, double px_per_deg, vect2_t center);
+void hud_conformal_disable(hud_t *hud);
+bool hud_conformal_is_enabled(const hud_t *hud);
+void hud_conformal_submit(hud_t *hud, const uint8_t *pixels,
+    size_t stride, const hud_rect_t *rects, unsigned num_rects,
+    double pitch, double roll, double hdg);
+
+bool hud_trace_start(hud_t *hud, const char *filename, bool surf_pixels);
+void hud_trace_stop(hud_t *hud);
+bool hud_trace_is_active(const hud_t *hud);
+
+bool hud_get_stats(const hud_t *hud, hud_stats_t *stats);
+void hud_reset_stats(hud_t *hud);
+size_t hud_stats_fmt_json(const hud_stats_t *stats, char *buf, size_t cap);
+void hud_set_trace_cb(hud_t *hud, hud_trace_cb_t cb, void *userinfo);
 
 #ifdef __cplusplus
 }